@@ -0,0 +1,156 @@
+/*
+    recall of the coarse-to-fine scan of tr_identify_ex
+    builds 10-minute synthetic broadcasts at 8 kHz (resonant noise whose
+    pitch drifts every 100 ms), each with one ad of 0.25 to 4 s inserted 4
+    to 11 times at a gain of 0.9 to 1.2 under 6 to 30 dB of white noise, and
+    scans each with decimation 0 (exhaustive) and with decimation d. a match
+    counts as found when the coarse scan reports the same start; the other
+    matches it reports are counted apart (none are expected with overlap).
+
+    usage: coarse_recall [d [first_seed [seeds [overlap]]]]   (defaults 8 1 7 0)
+    each seed runs 30 broadcasts.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#include "../sound_seg.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define RATE 8000
+#define PI 3.14159265358979323846
+#define BROADCASTS 30
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static double gauss(void) {
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * PI * v);
+}
+
+static int16_t clip(double v) {
+    return v > 32767 ? 32767 : v < -32768 ? -32768 : (int16_t)v;
+}
+
+// an AR(2) resonance whose frequency and damping change every 800 samples, plus a little white noise
+static void program(int16_t* x, size_t n, double amp) {
+    double y1 = 0.0, y2 = 0.0;
+    double f = 200 + rand() % 800;
+    double r = 0.97;
+    for (size_t i = 0; i < n; i++) {
+        if (i % 800 == 0) {
+            f = 150 + rand() % 1500;
+            r = 0.9 + 0.09 * (rand() / (double)RAND_MAX);
+        }
+        double a1 = 2.0 * r * cos(2.0 * PI * f / RATE);
+        double a2 = -r * r;
+        double y = a1 * y1 + a2 * y2 + gauss();
+        y2 = y1;
+        y1 = y;
+        x[i] = clip(amp * (0.05 * y + 0.02 * gauss()));
+    }
+}
+
+// true if the scan falls back to exhaustive for ad: under 8 whole blocks, or
+// under 40% of its energy kept by the block sums (the rule in sound_seg.c)
+static int falls_back(const int16_t* ad, size_t alen, size_t d) {
+    size_t m = alen / d;
+    if (m < 8) return 1;
+    double energy = 0.0, fp_energy = 0.0;
+    for (size_t i = 0; i < alen; i++) energy += (double)ad[i] * ad[i];
+    for (size_t b = 0; b < m; b++) {
+        double sum = 0.0;
+        for (size_t k = 0; k < d; k++) sum += ad[b * d + k];
+        fp_energy += sum * sum;
+    }
+    return fp_energy / (double)d < 0.4 * energy;
+}
+
+int main(int argc, char** argv) {
+    size_t d = argc > 1 ? (size_t)atoi(argv[1]) : 8;
+    unsigned first_seed = argc > 2 ? (unsigned)atoi(argv[2]) : 1;
+    unsigned seeds = argc > 3 ? (unsigned)atoi(argv[3]) : 7;
+    bool overlap = argc > 4 && atoi(argv[4]) != 0;
+
+    size_t total = 0, found = 0, extra = 0, ads = 0, fallbacks = 0;
+    double exhaustive_time = 0.0, coarse_time = 0.0;
+    size_t tlen = (size_t)RATE * 600;
+    int16_t* t = malloc(tlen * sizeof(int16_t));
+    int16_t* a = malloc((size_t)32000 * sizeof(int16_t));
+    if (!t || !a) return 1;
+
+    for (unsigned seed = first_seed; seed < first_seed + seeds; seed++) {
+        srand(seed);
+        size_t seed_total = 0, seed_found = 0;
+        for (int run = 0; run < BROADCASTS; run++) {
+            program(t, tlen, 300 + rand() % 400);
+            size_t alen = 2000 + rand() % 30000;
+            program(a, alen, 300 + rand() % 400);
+            double ea = 0.0;
+            for (size_t i = 0; i < alen; i++) ea += (double)a[i] * a[i];
+            int breaks = 4 + rand() % 8;
+            for (int j = 0; j < breaks; j++) {
+                size_t at = rand() % (tlen - alen);
+                double gain = 0.9 + 0.3 * rand() / RAND_MAX;
+                double snr = 6 + 24.0 * rand() / RAND_MAX;
+                double noise = sqrt(ea / alen) * pow(10, -snr / 20);
+                for (size_t i = 0; i < alen; i++) t[at + i] = clip(gain * a[i] + noise * gauss());
+            }
+            ads++;
+            fallbacks += falls_back(a, alen, d);
+
+            struct sound_seg* target = tr_init();
+            struct sound_seg* ad = tr_init();
+            if (!target || !ad) return 1;
+            tr_write(target, t, 0, tlen);
+            tr_write(ad, a, 0, alen);
+            struct ad_identify_options opts;
+            ad_identify_options_init(&opts);
+            opts.overlap = overlap;
+            struct ad_hit_list ex = { 0 }, co = { 0 };
+            double t0 = now();
+            if (!tr_identify_ex(target, ad, &opts, &ex)) return 1;
+            exhaustive_time += now() - t0;
+            opts.decimation = d;
+            t0 = now();
+            if (!tr_identify_ex(target, ad, &opts, &co)) return 1;
+            coarse_time += now() - t0;
+
+            //both lists are sorted by start
+            size_t j = 0, same = 0;
+            for (size_t i = 0; i < ex.count; i++) {
+                while (j < co.count && co.hits[j].start < ex.hits[i].start) j++;
+                if (j < co.count && co.hits[j].start == ex.hits[i].start) {
+                    same++;
+                } else {
+                    printf("  seed %u run %d: missed start %zu score %.4f ad %zu samples\n", seed, run,
+                           ex.hits[i].start, ex.hits[i].score, alen);
+                }
+            }
+            seed_total += ex.count;
+            seed_found += same;
+            extra += co.count - same;
+            ad_hit_list_free(&ex);
+            ad_hit_list_free(&co);
+            tr_destroy(target);
+            tr_destroy(ad);
+        }
+        printf("seed %u: %zu of %zu matches found\n", seed, seed_found, seed_total);
+        total += seed_total;
+        found += seed_found;
+    }
+
+    printf("d = %zu%s: %zu of %zu exhaustive matches found, %zu other matches reported\n", d, overlap ? " with overlap" : "", found, total, extra);
+    printf("%zu of %zu ads fell back to the exhaustive scan\n", fallbacks, ads);
+    printf("exhaustive %.2f s, coarse %.2f s (%.1fx)\n", exhaustive_time, coarse_time,
+           coarse_time > 0.0 ? exhaustive_time / coarse_time : 0.0);
+    free(t);
+    free(a);
+    return 0;
+}
@@ -1,29 +1,114 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "sound_seg.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define DOT_X86 1
+#include <immintrin.h>
+#endif
+
+// a file mapping the buffers lying in it share, unmapped with the last of them
+typedef struct file_map {
+    void* addr;
+    size_t len;
+    size_t refs; // buffers in the mapping
+} file_map;
+
+// a block of samples viewed by one or more nodes, freed with the last view
+typedef struct sample_buf {
+    int16_t* samples; // array(pointer) of samples (NULL and not packed: silence)
+    size_t length; // samples in use, the node ending here may grow into the rest
+    size_t capacity;
+    size_t refs; // nodes viewing the buffer
+    size_t owners; // scratch for tr_compact: the track's owned nodes on the buffer
+    size_t viewers; // and its shared ones (tr_compress_cold: visited)
+    file_map* map; // file mapping the samples lie in (NULL: arena memory)
+    unsigned char* packed; // the samples coded by tr_compress_cold (samples is NULL and length fixed then)
+    size_t packed_len;
+    unsigned packings; // times the buffer was packed, tells blocks decoded from an earlier packing apart
+    bool used; // read or written since the last tr_compress_cold
+} sample_buf;
 
 typedef struct seg_node {
-    int16_t* samples; // array(pointer) of samples
+    sample_buf* buf; // the node's samples are buf->samples[offset, offset + length), NULL or a silent buffer: silence
+    size_t offset;
     size_t length;
-    bool shared; // judge if shared
-    struct sound_seg* parent; // if the data is shared, point to the track
-    struct seg_node* next; // if the data is shared, point to the next track
-    size_t parent_offset;
+    bool shared; // judge if shared: the buffer belongs to another track's node or a file, copy before writing
+    struct seg_node* next; // next node of the track
+    struct seg_node* prev; // previous node of the track
+
+    // position index: a treap ordered by position, heap ordered by priority
+    struct seg_node* left;
+    struct seg_node* right;
+    struct seg_node* up;
+    size_t subtree_len; // samples held by this node and its subtree
+    uint32_t priority;
 } seg_node;
 
+// nodes per slab of a track's node pool
+#define NODE_SLAB 64
+
+typedef struct node_slab {
+    struct node_slab* next;
+    seg_node nodes[NODE_SLAB];
+} node_slab;
+
 typedef struct sound_seg {
     seg_node* head;
+    seg_node* tail; // last node, appends extend it
     size_t length;
+    seg_node* root; // root of the position index
+    uint32_t seed; // priority generator of the index
+    node_slab* slabs; // every node of the track comes from these
+    seg_node* free_nodes; // unused slab nodes, linked by next
+    size_t nodes; // nodes in the track
+    size_t compact_min_len; // auto compaction: least average node length, 0 = off
+    size_t compact_floor; // auto compaction waits until nodes reaches this
+    size_t silence_min_len; // tr_write and tr_compact store zero runs this long as silence, 0 = off
+    size_t version; // bumped by every edit, read cursors find their node again when it changes
 } sound_seg;
 
 double cross_correlation(const int16_t* a, const int16_t* b, size_t len);
 double auto_correlation(const int16_t* a, size_t len);
 
+// stdio buffer of a reader
+#define WAV_IO_BUFFER ((size_t)1 << 20)
+// samples wav_read_track moves per read
+#define WAV_TRACK_BLOCK ((size_t)1 << 16)
+
 // Load a WAV file into buffer
 void wav_load(const char* filename, int16_t* dest){
+    //the data chunk of a file the reader understands
+    struct wav_reader* r = wav_open(filename);
+    if (r) {
+        //callers size dest from the file, converted files may not write more than a raw copy
+        struct stat st;
+        size_t left = stat(filename, &st) == 0 && st.st_size > 44 ? (size_t)(st.st_size - 44) / sizeof(int16_t) : 0;
+        size_t n;
+        while (dest && left > 0 && (n = wav_read(r, dest, left < WAV_TRACK_BLOCK ? left : WAV_TRACK_BLOCK)) > 0) {
+            dest += n;
+            left -= n;
+        }
+        wav_close(r);
+        return;
+    }
+
+    //anything else: the raw bytes after a 44-byte header
     // fopen file, read
     FILE* f = fopen(filename, "rb");
     if (!f) return;
@@ -46,12 +131,11 @@ void wav_load(const char* filename, int16_t* dest){
     return;
 }
 
-// Create/write a WAV file from buffer
-void wav_save(const char* fname, int16_t* src, size_t len){
-    //open file
-    FILE *f = fopen(fname, "wb");
-    if (!f) return;
+// size of the header wav_save writes
+#define WAV_HEADER_SIZE 44
 
+// fill the 44-byte header of a 8000 Hz 16-bit mono PCM file of len samples
+static void wav_header(unsigned char* h, size_t len) {
     //calculate datasize
     uint32_t dataSize = (uint32_t)(len * sizeof(int16_t));
 
@@ -61,14 +145,14 @@ void wav_save(const char* fname, int16_t* src, size_t len){
     chunkSize = total - 8 = 36 + dataSize
     */
     uint32_t chunkSize = 36 + dataSize;
-    fwrite("RIFF", 1, 4, f);
-    fwrite(&chunkSize, sizeof(uint32_t), 1, f);
-    fwrite("WAVE", 1, 4, f);
+    memcpy(h, "RIFF", 4);
+    memcpy(h + 4, &chunkSize, sizeof(uint32_t));
+    memcpy(h + 8, "WAVE", 4);
 
     //fmt fmt + subchunk1Size + PCM
-    fwrite("fmt ", 1, 4, f);
+    memcpy(h + 12, "fmt ", 4);
     uint32_t subchunk1Size = 16; // PCM
-    fwrite(&subchunk1Size, sizeof(uint32_t), 1, f);
+    memcpy(h + 16, &subchunk1Size, sizeof(uint32_t));
 
     uint16_t audioFormat = 1; // PCM not compressed
     uint16_t numChannels = 1; // 1 mono, 2 stereo
@@ -76,17 +160,29 @@ void wav_save(const char* fname, int16_t* src, size_t len){
     uint16_t bitsPerSample = 16; // 16bits
     uint32_t sampleRate = 8000; //8000hz
     uint32_t byteRate = sampleRate * numChannels * 2; // num of bytes per second
-    
-    fwrite(&audioFormat, sizeof(uint16_t), 1, f);
-    fwrite(&numChannels, sizeof(uint16_t), 1, f);
-    fwrite(&sampleRate, sizeof(uint32_t), 1, f);
-    fwrite(&byteRate, sizeof(uint32_t), 1, f);
-    fwrite(&blockAlign, sizeof(uint16_t), 1, f);
-    fwrite(&bitsPerSample, sizeof(uint16_t), 1, f);
+
+    memcpy(h + 20, &audioFormat, sizeof(uint16_t));
+    memcpy(h + 22, &numChannels, sizeof(uint16_t));
+    memcpy(h + 24, &sampleRate, sizeof(uint32_t));
+    memcpy(h + 28, &byteRate, sizeof(uint32_t));
+    memcpy(h + 32, &blockAlign, sizeof(uint16_t));
+    memcpy(h + 34, &bitsPerSample, sizeof(uint16_t));
 
     //write sub data
-    fwrite("data", 1, 4, f);
-    fwrite(&dataSize, sizeof(uint32_t), 1, f);
+    memcpy(h + 36, "data", 4);
+    memcpy(h + 40, &dataSize, sizeof(uint32_t));
+}
+
+// Create/write a WAV file from buffer
+void wav_save(const char* fname, const int16_t* src, size_t len){
+    //open file
+    FILE *f = fopen(fname, "wb");
+    if (!f) return;
+
+    //the header goes out in one write
+    unsigned char header[WAV_HEADER_SIZE];
+    wav_header(header, len);
+    fwrite(header, 1, WAV_HEADER_SIZE, f);
 
     // write data in wav file
     fwrite(src, sizeof(int16_t), len, f);
@@ -95,604 +191,4646 @@ void wav_save(const char* fname, int16_t* src, size_t len){
     return;
 }
 
-// Initialize a new sound_seg object -> empty ll
-struct sound_seg* tr_init() {
-    sound_seg* track = malloc(sizeof(struct sound_seg));
-    // allocate memory failed
-    if (!track) return NULL;
+/*
+    position index
+    every track keeps its nodes twice: as a doubly linked list (head, next, prev)
+    in track order, and as a treap whose in-order walk is the same list.
+    each tree node caches the length of its subtree, so finding the node that
+    holds a position costs O(log n) instead of walking from head.
+*/
 
-    // initialize
-    track->head = NULL;
-    track->length = 0;
-    return track;
+// priority for a new index node (xorshift32)
+static uint32_t idx_priority(sound_seg* track) {
+    uint32_t x = track->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    track->seed = x;
+    return x;
 }
 
-// Destroy a sound_seg object and free all allocated memory (except shared)
-void tr_destroy(struct sound_seg* track) {
-    // if the pointer is null return
-    if (!track) return;
+// recompute the cached length of a subtree from its children
+static void idx_pull(seg_node* node) {
+    node->subtree_len = node->length;
+    if (node->left) node->subtree_len += node->left->subtree_len;
+    if (node->right) node->subtree_len += node->right->subtree_len;
+}
 
-    seg_node* curr = track->head;
-    // free the memory if its not null
-    while (curr) {
-        seg_node* next = curr->next;
-        
-        // release sample didn't shared and parent don't have child
-        if (curr-> samples && (!curr->shared || !curr->parent)) {
-            free(curr->samples);
-        }
-        free(curr);
-        curr = next;
+// refresh the cached lengths from node up to the root (after node->length changed)
+static void idx_fix_path(seg_node* node) {
+    while (node) {
+        idx_pull(node);
+        node = node->up;
     }
-    free(track);
-    return;
 }
 
-// Return the length of the segment
-size_t tr_length(struct sound_seg* seg) {
-    if (!seg) return 0;
-    return seg->length;
-    //return (size_t)-1;
+// rotate node above its tree parent, keeping the in-order sequence
+static void idx_rotate_up(sound_seg* track, seg_node* node) {
+    seg_node* p = node->up;
+    seg_node* g = p->up;
+
+    if (p->left == node) {
+        p->left = node->right;
+        if (node->right) node->right->up = p;
+        node->right = p;
+    } else {
+        p->right = node->left;
+        if (node->left) node->left->up = p;
+        node->left = p;
+    }
+    p->up = node;
+    node->up = g;
+
+    if (!g) {
+        track->root = node;
+    } else if (g->left == p) {
+        g->left = node;
+    } else {
+        g->right = node;
+    }
+    idx_pull(p);
+    idx_pull(node);
 }
 
-// Read len elements from position pos into dest (e in pos-> pos + len copy)
-void tr_read(struct sound_seg* track, int16_t* dest, size_t pos, size_t len) {
-    //check if track samples and dest is null
-    if (!track || !dest) return;
-    if (pos >= track->length) return;
+// link node into the track right after at (at == NULL: at the front)
+static void idx_insert_after(sound_seg* track, seg_node* at, seg_node* node) {
+    //list links
+    node->prev = at;
+    node->next = at ? at->next : track->head;
+    if (node->next) node->next->prev = node;
+    if (at) {
+        at->next = node;
+    } else {
+        track->head = node;
+    }
+    if (!node->next) track->tail = node;
+    track->nodes++;
 
-    //elements in len can be read
-    size_t can_read = track->length - pos;
-
-    //if len > can_read let it be can_read
-    if (len > can_read) len = can_read;
-
-    //count the number have read and position
-    size_t totalRead = 0;
-    size_t segStart = 0; //start of each node(segment)
-
-    //iterate node of the linked list
-    seg_node* curr = track->head;
-    while(curr && totalRead < len) {
-        size_t segEnd = segStart + curr->length;
-        
-        //find what node pos in if not jump to the next node
-        if (pos < segEnd) {
-            size_t offsetInNode;
-            if (pos > segStart) {
-                offsetInNode = pos - segStart;
-            } else {
-                offsetInNode = 0;
-            }
+    //tree links: node becomes the in-order successor of at
+    node->left = NULL;
+    node->right = NULL;
+    node->subtree_len = node->length;
+    node->priority = idx_priority(track);
+    if (!track->root) {
+        node->up = NULL;
+        track->root = node;
+    } else if (at && !at->right) {
+        at->right = node;
+        node->up = at;
+    } else {
+        //the old successor is the leftmost node of the subtree, so it has no left child
+        node->next->left = node;
+        node->up = node->next;
+    }
+    idx_fix_path(node->up);
 
-            size_t available = curr->length - offsetInNode; //see how much left can be read in node from offset
-            size_t toRead;
+    //restore the heap order
+    while (node->up && node->up->priority < node->priority) {
+        idx_rotate_up(track, node);
+    }
+}
 
-            //see if available is enough if not jump to the next node to read left
-            if (len - totalRead < available) {
-                toRead = len - totalRead;
-            } else {
-                toRead = available;
-            }
-            //check if the data is shared
-            if (curr->shared && curr->parent) {
-                //find the node of parent
-                size_t parent_pos = 0;
-                seg_node* parent_curr = curr->parent->head;
-                
-                while (parent_curr) {
-                    if (parent_pos + parent_curr->length > curr->parent_offset + offsetInNode) {
-                        //found node of parent and read data
-                        size_t parent_offset = curr->parent_offset + offsetInNode - parent_pos;
-
-                        //check if parent node is shared(parent has parent)
-                        if (parent_curr->shared && parent_curr->parent) {
-                            seg_node* data_node = parent_curr;
-                            size_t data_offset = parent_offset;
-
-                            //find the parent of parent
-                            int max_depth = 10;
-                            while (data_node->shared && data_node->parent && max_depth > 0) {
-                                size_t node_pos = 0;
-                                seg_node* p_node = data_node->parent->head;
-                                while (p_node) {
-                                    if (node_pos + p_node->length > data_node->parent_offset + data_offset) {
-                                        data_node = p_node;
-                                        data_offset = data_node->parent_offset + data_offset - node_pos;
-                                        break;
-                                    }
-                                    node_pos += p_node->length;
-                                    p_node = p_node->next;
-                                }
-                                max_depth--;
-                                if (!p_node) break;
-                            }
-                            //find data and read
-                            memcpy(dest + totalRead, data_node->samples + data_offset, toRead * sizeof(int16_t));
-
-                        } else {
-                            //parent node is not shared read
-                            memcpy(dest + totalRead, parent_curr->samples + parent_offset, toRead * sizeof(int16_t));
-                        }
-                        break;
-                    }
-                    parent_pos += parent_curr->length;
-                    parent_curr = parent_curr->next;
-                }
-                //if cannot find
-                if(!parent_curr) {
-                    memset(dest + totalRead, 0, toRead * sizeof(int16_t));
-                }
-            } else {
-                //not shared node read
-                memcpy(dest + totalRead, curr->samples + offsetInNode, toRead * sizeof(int16_t));
-            }
-            //update the the position and read
-            totalRead += toRead;
-            pos += toRead;
+// unlink node from the track (the node itself is not freed)
+static void idx_remove(sound_seg* track, seg_node* node) {
+    //rotate node down until it has at most one child
+    while (node->left && node->right) {
+        if (node->left->priority > node->right->priority) {
+            idx_rotate_up(track, node->left);
+        } else {
+            idx_rotate_up(track, node->right);
         }
-        segStart = segEnd;
-        curr = curr->next;
     }
-    return;
-}
+    seg_node* child = node->left ? node->left : node->right;
+    seg_node* up = node->up;
+    if (child) child->up = up;
+    if (!up) {
+        track->root = child;
+    } else if (up->left == node) {
+        up->left = child;
+    } else {
+        up->right = child;
+    }
+    idx_fix_path(up);
 
-// Write len elements from src into position pos
-void tr_write(struct sound_seg* track, int16_t* src, size_t pos, size_t len) {
-    if (!track || !src || len == 0) return;
+    //list links
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        track->head = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    } else {
+        track->tail = node->prev;
+    }
+    track->nodes--;
+}
 
-    // if position is greater than length, set pos as the end of the track
-    if (pos > track->length) pos = track->length;
-    
-    //initialize
-    size_t totalWritten = 0;
-    size_t segStart = 0;
-    seg_node* curr = track->head;
-
-    // if len(pos) = len(track) or ll is empty, add new node at tail
-    if (pos == track->length || !curr) {
-        seg_node* newNode = (seg_node*)malloc(sizeof(seg_node));
-        if (!newNode) return;
-        //add space for new node
-        newNode->samples = (int16_t*)malloc(len * sizeof(int16_t));
-        if (!newNode->samples) {
-            free(newNode);
-            return;
-        }
-        //initialize new node
-        newNode->length = len;
-        newNode->shared = false;
-        newNode->parent = NULL;
-        newNode->next = NULL;
-        newNode->parent_offset = 0;
-        //copy data to new node
-        memcpy(newNode->samples, src, len * sizeof(int16_t));
-        //add new node to the end of the linked list
-        if (!track->head) {
-            track->head = newNode;
+// find the node holding pos, *node_start gets the position of its first sample
+static seg_node* idx_find(const sound_seg* track, size_t pos, size_t* node_start) {
+    seg_node* node = track->root;
+    size_t base = 0;
+    while (node) {
+        size_t left_len = node->left ? node->left->subtree_len : 0;
+        if (pos < base + left_len) {
+            node = node->left;
+        } else if (pos < base + left_len + node->length) {
+            *node_start = base + left_len;
+            return node;
         } else {
-            seg_node* current = track->head;
-            while (current->next) {
-                current = current->next;
-            }
-            current->next = newNode;
+            base += left_len + node->length;
+            node = node->right;
         }
-        //update the length of the track
-        track->length += len;
-        return;
     }
+    return NULL;
+}
 
-    //iterate through the linked list to find the position to write
-    while (curr && totalWritten < len) {
-        size_t segEnd = segStart + curr->length;
-        //judge if pos is in the current node
-        if (pos < segEnd) {
-            size_t offsetInNode;
-            if (pos > segStart) {
-                offsetInNode = pos - segStart;
-            } else {
-                offsetInNode = 0;
-            }
-            //calculate the length to write
-            size_t available = curr->length - offsetInNode;
-            size_t toWrite;
-            if (len - totalWritten < available) {
-                toWrite = len - totalWritten;
-            } else {
-                toWrite = available;
-            }
-            //check if the data is shared
-            if (curr->shared && curr->parent) {
-                //find the node of parent
-                int16_t* new_buf = malloc(curr->length * sizeof(int16_t));
-                if (!new_buf) return;
-                tr_read(curr->parent, new_buf, curr->parent_offset, curr->length);
-                curr->samples = new_buf;
-                curr->shared = false;
-                curr->parent = NULL;
-                curr->parent_offset = 0;
-                memcpy(curr->samples + offsetInNode, src + totalWritten, toWrite * sizeof(int16_t));
-                
-            } else {
-                //if the data is not shared, write to the current node
-                memcpy(curr->samples + offsetInNode, src + totalWritten, toWrite * sizeof(int16_t));
-            }
-            //update the length of the track
-            totalWritten += toWrite;
-            pos += toWrite;
+// rebuild the index of the list from head in O(n), keeping the priorities;
+// the tree's right spine is the chain of up links from the last node added
+static void idx_rebuild(sound_seg* track) {
+    seg_node* last = NULL;
+    track->root = NULL;
+    for (seg_node* node = track->head; node; node = node->next) {
+        //lower nodes on the spine end up in node's left subtree, complete
+        seg_node* child = NULL;
+        while (last && last->priority < node->priority) {
+            idx_pull(last);
+            child = last;
+            last = last->up;
+        }
+        node->left = child;
+        node->right = NULL;
+        if (child) child->up = node;
+        node->up = last;
+        if (last) {
+            last->right = node;
+        } else {
+            track->root = node;
         }
-        //move to the next node
-        segStart = segEnd;
-        curr = curr->next;
+        last = node;
     }
+    while (last) {
+        idx_pull(last);
+        last = last->up;
+    }
+}
 
-    //if data is not written done, add new node to store the rest
-    if (totalWritten < len) {
-        size_t remaining = len - totalWritten;
-        seg_node* new_node = (seg_node*)malloc(sizeof(seg_node));
-        if (!new_node) return;
+/*
+    allocation
+    tracks, nodes and sample buffers get their memory from the allocator hooks
+    (malloc and free unless tr_set_allocator replaced them). nodes are carved
+    from slabs owned by their track, which tr_destroy frees in one go. sample
+    buffers are shared between tracks, so they come from one process-wide
+    arena: sizes up to ARENA_MAX_CLASS samples round up to a power of two and
+    freed blocks wait on the free list of their size class for the next
+    buffer of that class instead of going back to the hooks.
+*/
 
-        //allocate memory for the new node
-        new_node->samples = (int16_t*)malloc(remaining * sizeof(int16_t));
-        if (!new_node->samples) {
-            free(new_node);
-            return;
-        }
-        //initialize the new node
-        new_node->length = remaining;
-        new_node->shared = false;
-        new_node->parent = NULL;
-        new_node->next = NULL;
-        new_node->parent_offset = 0;
+static void* default_alloc(size_t size, void* ctx) {
+    (void)ctx;
+    return malloc(size);
+}
 
-        //copy the data to the new node
-        memcpy(new_node->samples, src + totalWritten, remaining * sizeof(int16_t));
+static void default_free(void* ptr, size_t size, void* ctx) {
+    (void)size;
+    (void)ctx;
+    free(ptr);
+}
 
-        //add the new node to the end of the linked list
-        seg_node* current = track->head;
-        while (current->next) {
-            current = current->next;
-        }
-        current->next = new_node;
+static struct sound_allocator allocator = { default_alloc, default_free, NULL };
 
-        //update the length of the track
-        track->length += remaining;
-    }
+static void* mem_alloc(size_t size) {
+    return allocator.alloc(size, allocator.ctx);
+}
 
-    return;
+static void mem_free(void* ptr, size_t size) {
+    if (ptr) allocator.free(ptr, size, allocator.ctx);
+}
+
+// smallest and largest size class of the sample arena (log2 of the samples)
+#define ARENA_MIN_CLASS 6
+#define ARENA_MAX_CLASS 16
+// free bytes a size class keeps for reuse, the rest goes back to the hooks
+#define ARENA_CLASS_CACHE ((size_t)1 << 20)
+
+typedef struct arena_block {
+    struct arena_block* next;
+} arena_block;
+
+static struct {
+    arena_block* free[ARENA_MAX_CLASS + 1]; // free blocks of each size class
+    size_t cached[ARENA_MAX_CLASS + 1]; // their bytes
+    arena_block* free_headers; // free sample_buf headers
+    size_t cached_headers;
+} arena;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
 
+// size class of a capacity, -1 for buffers too large to pool
+static int arena_class(size_t capacity) {
+    int c = ARENA_MIN_CLASS;
+    while (c <= ARENA_MAX_CLASS && ((size_t)1 << c) < capacity) c++;
+    return c <= ARENA_MAX_CLASS ? c : -1;
 }
 
-// Delete a range of elements from the track
-bool tr_delete_range(struct sound_seg* track, size_t pos, size_t len) {
-    //edge
-    if (!track || !track->head || !track->head->samples) return false;
-    if (pos >= track->length) return false;
-    if (pos + len > track->length) len = track->length - pos;
+// the capacity a buffer of at least n samples gets
+static size_t arena_capacity(size_t n) {
+    int c = arena_class(n);
+    return c < 0 ? n : (size_t)1 << c;
+}
 
-    size_t offset = 0;
-    size_t deleted = 0;
-    seg_node* prev = NULL;
-    seg_node* node = track->head;
+// pop a free block of class c (NULL if there is none)
+static void* arena_pop(arena_block** list, size_t* cached, size_t bytes) {
+    pthread_mutex_lock(&arena_lock);
+    arena_block* block = *list;
+    if (block) {
+        *list = block->next;
+        *cached -= bytes;
+    }
+    pthread_mutex_unlock(&arena_lock);
+    return block;
+}
 
-    while (node && offset + node->length <= pos) {
-        offset += node->length;
-        prev = node;
-        node = node->next;
+// keep a freed block for reuse unless its list is full, true if kept
+static bool arena_push(arena_block** list, size_t* cached, void* ptr, size_t bytes) {
+    pthread_mutex_lock(&arena_lock);
+    bool keep = *cached + bytes <= ARENA_CLASS_CACHE;
+    if (keep) {
+        arena_block* block = (arena_block*)ptr;
+        block->next = *list;
+        *list = block;
+        *cached += bytes;
     }
+    pthread_mutex_unlock(&arena_lock);
+    return keep;
+}
 
-    while (node && deleted < len) {
-        size_t node_start;
-        if (pos > offset) {
-            node_start = pos - offset;
-        } else {
-            node_start = 0;
+// samples for a buffer of capacity (from arena_capacity)
+static int16_t* arena_alloc(size_t capacity) {
+    size_t bytes = capacity * sizeof(int16_t);
+    int c = arena_class(capacity);
+    void* block = c < 0 ? NULL : arena_pop(&arena.free[c], &arena.cached[c], bytes);
+    return (int16_t*)(block ? block : mem_alloc(bytes));
+}
+
+static void arena_free(int16_t* samples, size_t capacity) {
+    size_t bytes = capacity * sizeof(int16_t);
+    int c = arena_class(capacity);
+    if (c < 0 || !arena_push(&arena.free[c], &arena.cached[c], samples, bytes)) mem_free(samples, bytes);
+}
+
+// give every cached block back to the hooks
+static void arena_drain(void) {
+    pthread_mutex_lock(&arena_lock);
+    for (int c = ARENA_MIN_CLASS; c <= ARENA_MAX_CLASS; c++) {
+        while (arena.free[c]) {
+            arena_block* block = arena.free[c];
+            arena.free[c] = block->next;
+            mem_free(block, ((size_t)1 << c) * sizeof(int16_t));
         }
-        size_t remainingToDeleted = len - deleted;
-        size_t nodeDeletedLen;
-        if (node_start + remainingToDeleted <= node->length) {
-            nodeDeletedLen = remainingToDeleted;
-        } else {
-            nodeDeletedLen = node->length - node_start;
+        arena.cached[c] = 0;
+    }
+    while (arena.free_headers) {
+        arena_block* block = arena.free_headers;
+        arena.free_headers = block->next;
+        mem_free(block, sizeof(sample_buf));
+    }
+    arena.cached_headers = 0;
+    pthread_mutex_unlock(&arena_lock);
+}
+
+// Replace the allocator hooks (NULL: back to malloc/free)
+void tr_set_allocator(const struct sound_allocator* hooks) {
+    //cached blocks go back to the hooks that allocated them
+    arena_drain();
+    if (hooks && hooks->alloc && hooks->free) {
+        allocator = *hooks;
+    } else {
+        allocator.alloc = default_alloc;
+        allocator.free = default_free;
+        allocator.ctx = NULL;
+    }
+}
+
+// a node from the track's slabs, uninitialized; NULL if out of memory
+static seg_node* node_alloc(sound_seg* track) {
+    if (!track->free_nodes) {
+        node_slab* slab = (node_slab*)mem_alloc(sizeof(node_slab));
+        if (!slab) return NULL;
+        slab->next = track->slabs;
+        track->slabs = slab;
+        for (size_t i = 0; i < NODE_SLAB; i++) {
+            slab->nodes[i].next = track->free_nodes;
+            track->free_nodes = &slab->nodes[i];
         }
+    }
+    seg_node* node = track->free_nodes;
+    track->free_nodes = node->next;
+    return node;
+}
 
-        //if shared cannot deleted
-        if (node->shared) return false;
+/*
+    sample buffers
+    a node views a range of a reference counted buffer. the node that wrote the
+    samples owns them and writes in place; nodes inserted from it (shared) view
+    the same buffer, so they see those writes and read it directly however
+    many inserts away the samples came from. a shared node copies its range
+    before its first write. a buffer lives as long as any node views it, so
+    destroying the source track never leaves an inserted copy dangling.
+*/
 
-        //delete hole node
-        if (node_start == 0 && nodeDeletedLen == node->length) {
-            seg_node* toDelete = node;
-            node = node->next;
+// allocate a buffer of length samples, the caller holds its one reference
+static sample_buf* buf_new(size_t length) {
+    sample_buf* buf = (sample_buf*)arena_pop(&arena.free_headers, &arena.cached_headers, sizeof(sample_buf));
+    if (!buf) buf = (sample_buf*)mem_alloc(sizeof(sample_buf));
+    if (!buf) return NULL;
+    buf->capacity = arena_capacity(length ? length : 1);
+    buf->samples = arena_alloc(buf->capacity);
+    if (!buf->samples) {
+        mem_free(buf, sizeof(sample_buf));
+        return NULL;
+    }
+    buf->length = length;
+    buf->refs = 1;
+    buf->owners = 0;
+    buf->viewers = 0;
+    buf->map = NULL;
+    buf->packed = NULL;
+    buf->packed_len = 0;
+    buf->packings = 0;
+    buf->used = true;
+    return buf;
+}
 
-            if (prev) {
-                prev->next = node;
-            } else {
-                track->head = node;
-            }
-            if (toDelete->samples && !toDelete->shared) {
-                free(toDelete->samples);
-            }
-            free(toDelete);
-        }
-
-        //delete the head to somewhere
-        else if (node_start == 0) {
-            //if is not shared
-            if (!node->shared) {
-                memmove(node->samples, node->samples + nodeDeletedLen, (node->length - nodeDeletedLen) * sizeof(int16_t));
-                node->length -= nodeDeletedLen;
-                if (node->parent) node->parent_offset += nodeDeletedLen;
-            }       
-            //if is shared node
-            else {
-                seg_node* new_node = (seg_node*)malloc(sizeof(seg_node));
-                if (!new_node) return false;
-                new_node->length -= nodeDeletedLen;
-                new_node->shared = node->shared;
-                new_node->parent = node->parent;
-                new_node->parent_offset += nodeDeletedLen;
-                new_node->next = node->next;
-                if (prev) {
-                    prev->next = new_node;
-                } else {
-                    track->head = new_node;
-                }
-                free(node);
-                node = new_node;
-            }
-        }
-        //delete somewhere to tail
-        else if (node_start + nodeDeletedLen == node->length) {
-            node->length -= nodeDeletedLen;
-            prev = node;
-            node = node->next;
-        }
-        //delete middle
-        else {
-            //creat a node to store the rest
-            seg_node* after_node = (seg_node*)malloc(sizeof(seg_node));
-            if (!after_node) return false;
-            size_t after_len = node->length - node_start - nodeDeletedLen;
-            if (!node->shared) {
-                after_node->samples = malloc(after_len * sizeof(int16_t));
-                if (!after_node->samples) {
-                    free(after_node);
-                    return false;
-                }
-                memcpy(after_node->samples, node->samples + node_start + nodeDeletedLen, after_len * sizeof(int16_t));
-                after_node->length = after_len;
-                after_node->shared = false;
-                after_node->parent = NULL;
-                after_node->parent_offset = 0;
-            } else {
-                after_node->samples = NULL;
-                after_node->length = after_len;
-                after_node->shared = true;
-                after_node->parent = node->parent;
-                after_node->parent_offset = node->parent_offset + node_start + nodeDeletedLen;
-            }
-            after_node->next = node->next;
-            node->next = after_node;
-            node->length = node_start;
-            prev = after_node;
-            node = after_node->next;
-        }
-        deleted += nodeDeletedLen;
-        offset = offset + node_start + nodeDeletedLen;
-        pos += nodeDeletedLen;
+// drop a buffer's reference to a mapping, the last one unmaps it
+static void map_release(file_map* map) {
+    if (--map->refs > 0) return;
+    munmap(map->addr, map->len);
+    mem_free(map, sizeof(file_map));
+}
+
+// a buffer of length samples lying in map, the caller holds its one reference
+static sample_buf* buf_new_mapped(file_map* map, int16_t* samples, size_t length) {
+    sample_buf* buf = (sample_buf*)arena_pop(&arena.free_headers, &arena.cached_headers, sizeof(sample_buf));
+    if (!buf) buf = (sample_buf*)mem_alloc(sizeof(sample_buf));
+    if (!buf) return NULL;
+    buf->samples = samples;
+    buf->length = length;
+    buf->capacity = length;
+    buf->refs = 1;
+    buf->owners = 0;
+    buf->viewers = 0;
+    buf->map = map;
+    buf->packed = NULL;
+    buf->packed_len = 0;
+    buf->packings = 0;
+    buf->used = true;
+    map->refs++;
+    return buf;
+}
+
+// a silent buffer of length samples, the caller holds its one reference
+static sample_buf* buf_new_silent(size_t length) {
+    sample_buf* buf = (sample_buf*)arena_pop(&arena.free_headers, &arena.cached_headers, sizeof(sample_buf));
+    if (!buf) buf = (sample_buf*)mem_alloc(sizeof(sample_buf));
+    if (!buf) return NULL;
+    buf->samples = NULL;
+    buf->length = length;
+    buf->capacity = 0;
+    buf->refs = 1;
+    buf->owners = 0;
+    buf->viewers = 0;
+    buf->map = NULL;
+    buf->packed = NULL;
+    buf->packed_len = 0;
+    buf->packings = 0;
+    buf->used = true;
+    return buf;
+}
+
+// make room for at least capacity samples, growing geometrically; false if out of memory
+static bool buf_reserve(sample_buf* buf, size_t capacity) {
+    if (capacity <= buf->capacity) return true;
+    size_t new_capacity = buf->capacity * 2;
+    if (new_capacity < capacity) new_capacity = capacity;
+    new_capacity = arena_capacity(new_capacity);
+    //nodes find their samples through buf, so moving them is safe
+    int16_t* samples = arena_alloc(new_capacity);
+    if (!samples) return false;
+    memcpy(samples, buf->samples, buf->length * sizeof(int16_t));
+    //a mapped buffer moves to the arena, the file keeps its samples
+    if (buf->map) {
+        map_release(buf->map);
+        buf->map = NULL;
+    } else {
+        arena_free(buf->samples, buf->capacity);
     }
-    track->length -= len;
+    buf->samples = samples;
+    buf->capacity = new_capacity;
     return true;
 }
 
-// Returns a string containing <start>,<end> ad pairs in target
-char* tr_identify(const struct sound_seg* target, const struct sound_seg* ad) {
-    //check if target track or ad is empty
-    if (!target || !ad) {
-        char* empty = (char*)malloc(1);
-        if (empty) empty[0] = '\0';
-        return empty;
+// take another reference to buf (NULL: silence)
+static sample_buf* buf_ref(sample_buf* buf) {
+    if (buf) buf->refs++;
+    return buf;
+}
+
+// drop a reference, the last one frees the buffer
+static void buf_release(sample_buf* buf) {
+    if (!buf || --buf->refs > 0) return;
+    if (buf->packed) {
+        mem_free(buf->packed, buf->packed_len);
+    } else if (buf->map) {
+        map_release(buf->map);
+    } else if (buf->samples) {
+        arena_free(buf->samples, buf->capacity);
     }
-    
-    //use tr_length to get the length of the target
-    size_t tlen = tr_length((struct sound_seg*)target);
-    size_t alen = tr_length((struct sound_seg*)ad);
+    if (!arena_push(&arena.free_headers, &arena.cached_headers, buf, sizeof(sample_buf))) {
+        mem_free(buf, sizeof(sample_buf));
+    }
+}
 
-    //if the length of ad is greater than target or empty, return empty
-    if (tlen == 0 || alen == 0 || alen > tlen) {
-        char* empty = (char*)malloc(1);
-        if (empty) empty[0] = '\0';
-        return empty;
+// true if buf holds silence: the silent nodes inserted copies view share one,
+// so a write to the owner's range fills it in place and reaches them
+static bool buf_silent(const sample_buf* buf) {
+    return !buf->samples && !buf->packed;
+}
+
+// first sample of node, its buffer must not be packed or silent
+static int16_t* node_samples(const seg_node* node) {
+    return node->buf->samples + node->offset;
+}
+
+// allocate an unlinked node of track viewing buf[offset, offset + length), it
+// takes over the caller's reference to buf (the caller keeps it if this fails)
+static seg_node* node_new(sound_seg* track, sample_buf* buf, size_t offset, size_t length) {
+    seg_node* node = node_alloc(track);
+    if (!node) return NULL;
+    node->buf = buf;
+    node->offset = offset;
+    node->length = length;
+    node->shared = false;
+    node->next = NULL;
+    node->prev = NULL;
+    node->left = NULL;
+    node->right = NULL;
+    node->up = NULL;
+    node->subtree_len = length;
+    node->priority = 0;
+    return node;
+}
+
+// free a node of track and its reference to the buffer
+static void node_free(sound_seg* track, seg_node* node) {
+    buf_release(node->buf);
+    node->next = track->free_nodes;
+    track->free_nodes = node;
+}
+
+// free a chain of nodes of track linked by next
+static void node_free_list(sound_seg* track, seg_node* node) {
+    while (node) {
+        seg_node* next = node->next;
+        node_free(track, node);
+        node = next;
     }
+}
 
-    //use tr_read
-    int16_t* target_data = malloc(tlen * sizeof(int16_t));
-    int16_t* ad_data = malloc(alen * sizeof(int16_t));
-    
-    //allocate failed
-    if (!target_data || !ad_data) {
-        free(target_data);
-        free(ad_data);
-        char* empty = (char*)malloc(1);
-        if (empty) empty[0] = '\0';
-        return empty;
+// split node at offset (0 < offset < length), returns the new second half
+static seg_node* node_split(sound_seg* track, seg_node* node, size_t offset) {
+    //both halves view the same buffer, writes to either stay visible to its shared copies
+    seg_node* tail = node_new(track, buf_ref(node->buf), node->offset + offset, node->length - offset);
+    if (!tail) {
+        buf_release(node->buf);
+        return NULL;
     }
-    tr_read((struct sound_seg*)target, target_data, 0, tlen);
-    tr_read((struct sound_seg*)ad, ad_data, 0, alen);
-    
-    //calculate the auto correlation
-    double reference = auto_correlation(ad_data, alen);
-    double threshold = reference * 0.95;
+    tail->shared = node->shared;
+    node->length = offset;
+    idx_fix_path(node);
+    idx_insert_after(track, node, tail);
+    return tail;
+}
 
-    // initialize the first result
-    size_t initial_size = 256;
-    char* result = (char*)malloc(initial_size);
+// room for n samples at the end of track, to be filled and then committed; NULL if out of memory
+static int16_t* track_append_space(sound_seg* track, size_t n) {
+    //the last node grows in place when it owns the end of its unpacked buffer
+    seg_node* last = track->tail;
+    if (last && last->buf && !last->shared && last->buf->samples && last->offset + last->length == last->buf->length &&
+        buf_reserve(last->buf, last->buf->length + n)) {
+        last->buf->used = true;
+        return last->buf->samples + last->buf->length;
+    }
 
-    //allocate failed
-    if (!result) {
-        free(target_data);
-        free(ad_data);
+    //otherwise a new empty node at the tail grows instead
+    sample_buf* buf = buf_new(n);
+    if (!buf) return NULL;
+    buf->length = 0;
+    seg_node* node = node_new(track, buf, 0, 0);
+    if (!node) {
+        buf_release(buf);
         return NULL;
     }
-    result[0] = '\0';
-    size_t resultPos = 0;
-    size_t matchCount = 0;
-    size_t offset = 0;
-    size_t last_matched_end = 0;
-    size_t result_size = initial_size;
+    idx_insert_after(track, track->tail, node);
+    return buf->samples;
+}
 
-    /*
-        iterate target_data
-        [                 ]
-          [  ]-> [   ]
-    */
-    while (offset + alen <= tlen) {
-        if (offset <= last_matched_end) {
-            offset++;
-            continue;
+// append the first n samples of the space track_append_space gave
+static void track_append_commit(sound_seg* track, size_t n) {
+    seg_node* last = track->tail;
+    if (n == 0) {
+        if (last->length == 0) {
+            idx_remove(track, last);
+            node_free(track, last);
         }
+        return;
+    }
+    last->buf->length += n;
+    last->length += n;
+    idx_fix_path(last);
+    track->length += n;
+}
 
-        double cc = cross_correlation(target_data + offset, ad_data, alen);
-        if (cc >= threshold) {
-            size_t start = offset;
-            size_t end = offset + alen - 1; //index
-            last_matched_end = end;
-
-            //if it is not the first match, add \n
-            if (matchCount > 0) {
-                if (resultPos + 1 >= result_size) {
-                    //expend the size
-                    size_t new_size = result_size * 2;
-                    char* new_result = (char*)realloc(result, new_size);
-                    if (!new_result) break;
-                    result = new_result;
-                    result_size = new_size;
-                }
-                result[resultPos++] = '\n';
-                result[resultPos] = '\0';
-            }
-
-            //convert to str
-            char pair[64];
-            int written = snprintf(pair, sizeof(pair), "%zu,%zu", start, end);
-            if (written < 0) break;
-            if (written < 0 || written >= (int)sizeof(pair)) {
-                offset++;
-                break;
-            }
+// Initialize a new sound_seg object -> empty ll
+struct sound_seg* tr_init() {
+    sound_seg* track = mem_alloc(sizeof(struct sound_seg));
+    // allocate memory failed
+    if (!track) return NULL;
 
-            // check if has enough space
-            if (resultPos + written >= result_size) {
-                size_t new_size = result_size * 2;
-                while (new_size <= resultPos + written) {
-                    new_size *= 2;
-                }
-                char* new_result = (char*)realloc(result, new_size);
-                if (!new_result) break;
-                result = new_result; 
-            }
-            // add result to result
-            strcpy(result + resultPos, pair);
-            resultPos += written;
-            matchCount++;
-            //jump out this pos to search next
-            offset = end + 1;
-        } else {
-            offset++;
-        }
-    }
-    free(target_data);
-    free(ad_data);
-    return result;
+    // initialize
+    track->head = NULL;
+    track->tail = NULL;
+    track->length = 0;
+    track->root = NULL;
+    track->seed = 2463534242u;
+    track->slabs = NULL;
+    track->free_nodes = NULL;
+    track->nodes = 0;
+    track->compact_min_len = 0;
+    track->compact_floor = 0;
+    track->silence_min_len = 0;
+    track->version = 0;
+    return track;
 }
 
-// Insert a portion of src_track into dest_track at position destpos
-void tr_insert(struct sound_seg* src_track,
-            struct sound_seg* dest_track,
-            size_t destpos, size_t srcpos, size_t len) {
-    //check egde
-    if (!src_track || !dest_track || len == 0) return;
-    if (destpos > dest_track->length) destpos = dest_track->length;
-    if (srcpos >= src_track->length) return;
-    if (srcpos + len > src_track->length) len = src_track->length - srcpos;
-    if (len == 0) return;
-    seg_node* curr = dest_track->head; //iterate
-    seg_node* prev = NULL;
-    size_t segStart = 0;
+// Destroy a sound_seg object and free all allocated memory (buffers still viewed by other tracks stay)
+void tr_destroy(struct sound_seg* track) {
+    // if the pointer is null return
+    if (!track) return;
 
-    //iterate nodes of ll until find the pos
-    while (curr) {
-        size_t segEnd = segStart + curr->length;
-        if (destpos < segEnd) break;
-        segStart = segEnd;
-        prev = curr;
-        curr = curr->next;
+    // drop the buffer references, then free the nodes slab by slab
+    for (seg_node* node = track->head; node; node = node->next) {
+        buf_release(node->buf);
     }
-    if (curr) {
-        size_t offsetInNode = destpos - segStart;
-
-        //judge if it is in middle
-        if (offsetInNode > 0 && offsetInNode < curr->length) {
-            //let the second part in the tail node
-            seg_node* tail_node = (seg_node*)malloc(sizeof(seg_node));
-            if (!tail_node) return;
-            tail_node->length = curr->length - offsetInNode;
-            tail_node->shared = curr->shared;
-            tail_node->parent = curr->parent;
-            tail_node->parent_offset = curr->parent_offset + offsetInNode;
-            tail_node->next = curr->next;
-            if (curr->samples) {
-                tail_node->samples = malloc((curr->length - offsetInNode) * sizeof(int16_t));
-                if (!tail_node->samples) {
-                    free(tail_node);
-                    return;
-                }
-                memcpy(tail_node->samples, curr->samples + offsetInNode, (curr->length - offsetInNode) * sizeof(int16_t));
-            } else {
-                tail_node->samples = NULL;
-            }
-
-            //the first half data is curr
-            curr->length = offsetInNode;
-            curr->next = tail_node;
-        }
-
-        //creat shared node
-        seg_node* shared_node = (seg_node*)malloc(sizeof(seg_node));
-        if (!shared_node) return;
-        shared_node->length = len;
-        shared_node->shared = true;
-        shared_node->parent = (sound_seg*)src_track;
-        shared_node->parent_offset = srcpos;
-        shared_node->next = NULL;
-        shared_node->samples = NULL;
-
-        //insert the shared node
-        if (!dest_track->head) {
-            dest_track->head = shared_node;
-        } else if (!curr) {
-            if (prev) {
-                prev->next = shared_node;
-            } else {
-                dest_track->head = shared_node;
-            }
-        } else {
-            shared_node->next = curr->next;
-            curr->next = shared_node;
-        }
-        dest_track->length += len;
+    while (track->slabs) {
+        node_slab* next = track->slabs->next;
+        mem_free(track->slabs, sizeof(node_slab));
+        track->slabs = next;
     }
+    mem_free(track, sizeof(sound_seg));
     return;
 }
 
-double cross_correlation(const int16_t* a, const int16_t* b, size_t len) {
-    double corr = 0.0;
-    for (size_t i = 0; i < len; i++) {
-        corr += (double)a[i] * (double)b[i];
-    }
-    return corr;
+// Return the length of the segment
+size_t tr_length(struct sound_seg* seg) {
+    if (!seg) return 0;
+    return seg->length;
+    //return (size_t)-1;
+}
+
+/*
+    packed buffers
+    tr_compress_cold packs the buffers a track has not used since its
+    previous call with a lossless codec: each block of CODEC_BLOCK samples is
+    predicted by whichever of the fixed polynomial predictors of order 0 to 4
+    and a linear predictor fitted to the block leaves the smallest residuals,
+    and the residuals are Rice coded, with a parameter per partition of
+    CODEC_PARTITION residuals. blocks decode on their own, so reads (the span
+    iterator) decode just the blocks they cross into a small scratch block
+    and the buffer stays packed; only writing into it or growing it unpacks
+    it again. file mappings are left alone, the page cache can drop them.
+*/
+
+#define CODEC_BLOCK 1024
+#define CODEC_PARTITION 256
+// residuals with a larger Rice quotient are stored as CODEC_ESCAPE zeros, a one and CODEC_RAW_BITS bits
+#define CODEC_ESCAPE 24
+#define CODEC_RAW_BITS 24
+#define CODEC_MAX_ORDER 4
+// the linear predictor: CODEC_LPC_ORDER coefficients with CODEC_LPC_SHIFT fraction bits
+#define CODEC_LPC 0x10
+#define CODEC_LPC_ORDER 8
+#define CODEC_LPC_SHIFT 12
+// a block coded in more bits than this is stored verbatim
+#define CODEC_VERBATIM 0xFF
+// buffers shorter than this stay unpacked
+#define CODEC_MIN_LEN CODEC_BLOCK
+// bytes the decoder may read past the end of the data
+#define CODEC_PAD 8
+
+typedef struct {
+    unsigned char* p;
+    uint64_t acc; // pending bits, the oldest highest
+    int bits;
+} bit_writer;
+
+// append the low n bits of v, n <= 32
+static void bits_put(bit_writer* w, uint32_t v, int n) {
+    w->acc = (w->acc << n) | (v & (uint32_t)(((uint64_t)1 << n) - 1));
+    w->bits += n;
+    while (w->bits >= 8) {
+        w->bits -= 8;
+        *w->p++ = (unsigned char)(w->acc >> w->bits);
+    }
+}
+
+// pad the last byte with zeros
+static void bits_flush(bit_writer* w) {
+    if (w->bits > 0) bits_put(w, 0, 8 - w->bits);
+}
+
+typedef struct {
+    const unsigned char* p;
+    uint64_t cache; // the next bits, left aligned
+    int bits;
+} bit_reader;
+
+static void bits_refill(bit_reader* r) {
+    while (r->bits <= 56) {
+        r->cache |= (uint64_t)*r->p++ << (56 - r->bits);
+        r->bits += 8;
+    }
+}
+
+// take n bits, 1 <= n <= 32
+static uint32_t bits_get(bit_reader* r, int n) {
+    bits_refill(r);
+    uint32_t v = (uint32_t)(r->cache >> (64 - n));
+    r->cache <<= n;
+    r->bits -= n;
+    return v;
+}
+
+// the residual of sample i of x under the fixed predictor of an order
+static int32_t codec_residual(const int16_t* x, size_t i, int order) {
+    switch (order) {
+        case 0: return x[i];
+        case 1: return x[i] - x[i - 1];
+        case 2: return x[i] - 2 * x[i - 1] + x[i - 2];
+        case 3: return x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+        default: return x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+    }
+}
+
+// the prediction of sample i of x from the CODEC_LPC_ORDER samples before it
+static int32_t codec_lpc_predict(const int16_t* x, size_t i, const int32_t* coef) {
+    int64_t sum = 0;
+    for (int j = 0; j < CODEC_LPC_ORDER; j++) sum += (int64_t)coef[j] * x[i - 1 - j];
+    return (int32_t)((sum + ((int64_t)1 << (CODEC_LPC_SHIFT - 1))) >> CODEC_LPC_SHIFT);
+}
+
+// quantized linear prediction coefficients of n samples (Levinson-Durbin), false if there are none
+static bool codec_lpc(const int16_t* x, size_t n, int32_t* coef) {
+    double r[CODEC_LPC_ORDER + 1];
+    for (int lag = 0; lag <= CODEC_LPC_ORDER; lag++) {
+        double sum = 0.0;
+        for (size_t i = (size_t)lag; i < n; i++) sum += (double)x[i] * x[i - lag];
+        r[lag] = sum;
+    }
+    if (r[0] == 0.0) return false;
+    //a little white noise keeps the recursion stable
+    r[0] *= 1.0 + 1e-9;
+
+    double a[CODEC_LPC_ORDER + 1] = { 0 };
+    double prev[CODEC_LPC_ORDER + 1];
+    double err = r[0];
+    for (int m = 1; m <= CODEC_LPC_ORDER; m++) {
+        double acc = r[m];
+        for (int j = 1; j < m; j++) acc -= a[j] * r[m - j];
+        double k = acc / err;
+        memcpy(prev, a, sizeof(a));
+        a[m] = k;
+        for (int j = 1; j < m; j++) a[j] = prev[j] - k * prev[m - j];
+        err *= 1.0 - k * k;
+        if (err <= 0.0) return false;
+    }
+    for (int j = 0; j < CODEC_LPC_ORDER; j++) {
+        double q = a[j + 1] * (double)(1 << CODEC_LPC_SHIFT);
+        if (q >= 32767.0 || q <= -32767.0) return false;
+        coef[j] = (int32_t)(q < 0 ? q - 0.5 : q + 0.5);
+    }
+    return true;
+}
+
+// code n samples as one block at out, return the bytes used
+static size_t codec_encode_block(const int16_t* x, size_t n, unsigned char* out) {
+    //the predictor whose residuals are smallest, judged on the samples all of them predict
+    int order = 0;
+    uint64_t best = UINT64_MAX;
+    for (int o = 0; o <= CODEC_MAX_ORDER && (size_t)o < n; o++) {
+        uint64_t sum = 0;
+        for (size_t i = CODEC_LPC_ORDER; i < n; i++) {
+            int32_t e = codec_residual(x, i, o);
+            sum += (uint64_t)(e < 0 ? -(int64_t)e : e);
+        }
+        if (sum < best) {
+            best = sum;
+            order = o;
+        }
+    }
+    int32_t coef[CODEC_LPC_ORDER];
+    if (n > 2 * CODEC_LPC_ORDER && codec_lpc(x, n, coef)) {
+        uint64_t sum = 0;
+        for (size_t i = CODEC_LPC_ORDER; i < n && sum < best; i++) {
+            int32_t e = x[i] - codec_lpc_predict(x, i, coef);
+            //residuals must stay in the range of the fixed predictors
+            if (e >= (1 << 19) || e <= -(1 << 19)) {
+                sum = UINT64_MAX;
+                break;
+            }
+            sum += (uint64_t)(e < 0 ? -(int64_t)e : e);
+        }
+        if (sum < best) order = CODEC_LPC;
+    }
+
+    //the header, the warm-up samples the predictor starts from, then the residuals
+    int32_t res[CODEC_BLOCK];
+    size_t warm = order == CODEC_LPC ? CODEC_LPC_ORDER : (size_t)order;
+    bit_writer w = { out + 1, 0, 0 };
+    out[0] = (unsigned char)order;
+    if (order == CODEC_LPC) {
+        for (int j = 0; j < CODEC_LPC_ORDER; j++) bits_put(&w, (uint16_t)coef[j], 16);
+        for (size_t i = warm; i < n; i++) res[i] = x[i] - codec_lpc_predict(x, i, coef);
+    } else {
+        for (size_t i = warm; i < n; i++) res[i] = codec_residual(x, i, order);
+    }
+    for (size_t i = 0; i < warm; i++) bits_put(&w, (uint16_t)x[i], 16);
+
+    for (size_t part = 0; part < n; part += CODEC_PARTITION) {
+        size_t from = part < warm ? warm : part;
+        size_t to = part + CODEC_PARTITION < n ? part + CODEC_PARTITION : n;
+
+        //the Rice parameter that suits the mean residual
+        uint64_t sum = 0;
+        for (size_t i = from; i < to; i++) {
+            sum += ((uint32_t)res[i] << 1) ^ (uint32_t)-(res[i] < 0);
+        }
+        int k = 0;
+        while (k < 20 && ((uint64_t)(to - from) << (k + 1)) < sum) k++;
+        bits_put(&w, (uint32_t)k, 5);
+
+        for (size_t i = from; i < to; i++) {
+            //zigzag: 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+            uint32_t u = ((uint32_t)res[i] << 1) ^ (uint32_t)-(res[i] < 0);
+            uint32_t q = u >> k;
+            if (q < CODEC_ESCAPE) {
+                bits_put(&w, 1, (int)q + 1);
+                if (k > 0) bits_put(&w, u, k);
+            } else {
+                bits_put(&w, 1, CODEC_ESCAPE + 1);
+                bits_put(&w, u, CODEC_RAW_BITS);
+            }
+            //noise does not shrink, such blocks are kept as they are
+            if ((size_t)(w.p - out) >= n * sizeof(int16_t)) {
+                out[0] = CODEC_VERBATIM;
+                memcpy(out + 1, x, n * sizeof(int16_t));
+                return 1 + n * sizeof(int16_t);
+            }
+        }
+    }
+    bits_flush(&w);
+    return (size_t)(w.p - out);
+}
+
+// decode the n samples of the block at in
+static void codec_decode_block(const unsigned char* in, size_t n, int16_t* x) {
+    int order = in[0];
+    if (order == CODEC_VERBATIM) {
+        memcpy(x, in + 1, n * sizeof(int16_t));
+        return;
+    }
+    bit_reader r = { in + 1, 0, 0 };
+    int32_t coef[CODEC_LPC_ORDER];
+    size_t warm = order == CODEC_LPC ? CODEC_LPC_ORDER : (size_t)order;
+    if (order == CODEC_LPC) {
+        for (int j = 0; j < CODEC_LPC_ORDER; j++) coef[j] = (int16_t)bits_get(&r, 16);
+    }
+    if (warm > n) warm = n;
+    for (size_t i = 0; i < warm; i++) x[i] = (int16_t)bits_get(&r, 16);
+
+    int32_t res[CODEC_BLOCK];
+    for (size_t part = 0; part < n; part += CODEC_PARTITION) {
+        size_t from = part < warm ? warm : part;
+        size_t to = part + CODEC_PARTITION < n ? part + CODEC_PARTITION : n;
+        int k = (int)bits_get(&r, 5);
+        for (size_t i = from; i < to; i++) {
+            //the quotient in unary: zeros up to a one
+            bits_refill(&r);
+            int q = __builtin_clzll(r.cache);
+            r.cache <<= q + 1;
+            r.bits -= q + 1;
+            uint32_t u = q < CODEC_ESCAPE ? ((uint32_t)q << k) | (k > 0 ? bits_get(&r, k) : 0) : bits_get(&r, CODEC_RAW_BITS);
+            res[i] = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+        }
+    }
+
+    switch (order) {
+        case 0:
+            for (size_t i = warm; i < n; i++) x[i] = (int16_t)res[i];
+            break;
+        case 1:
+            for (size_t i = warm; i < n; i++) x[i] = (int16_t)(res[i] + x[i - 1]);
+            break;
+        case 2:
+            for (size_t i = warm; i < n; i++) x[i] = (int16_t)(res[i] + 2 * x[i - 1] - x[i - 2]);
+            break;
+        case 3:
+            for (size_t i = warm; i < n; i++) x[i] = (int16_t)(res[i] + 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3]);
+            break;
+        case 4:
+            for (size_t i = warm; i < n; i++) {
+                x[i] = (int16_t)(res[i] + 4 * x[i - 1] - 6 * x[i - 2] + 4 * x[i - 3] - x[i - 4]);
+            }
+            break;
+        default:
+            for (size_t i = warm; i < n; i++) x[i] = (int16_t)(res[i] + codec_lpc_predict(x, i, coef));
+            break;
+    }
+}
+
+// packed data: a uint32_t start per block and one past the last, relative to the blocks, then the blocks
+static size_t codec_blocks(size_t length) {
+    return (length + CODEC_BLOCK - 1) / CODEC_BLOCK;
+}
+
+// decode block b of a packed buffer into x, room for CODEC_BLOCK samples
+static void buf_decode(const sample_buf* buf, size_t b, int16_t* x) {
+    const uint32_t* starts = (const uint32_t*)buf->packed;
+    const unsigned char* blocks = buf->packed + (codec_blocks(buf->length) + 1) * sizeof(uint32_t);
+    size_t n = buf->length - b * CODEC_BLOCK < CODEC_BLOCK ? buf->length - b * CODEC_BLOCK : CODEC_BLOCK;
+    codec_decode_block(blocks + starts[b], n, x);
+}
+
+// copy buf[pos, pos + len) to dst, packed, silent or not
+static void buf_unpack(const sample_buf* buf, size_t pos, size_t len, int16_t* dst) {
+    if (buf->samples) {
+        memcpy(dst, buf->samples + pos, len * sizeof(int16_t));
+        return;
+    }
+    if (!buf->packed) {
+        memset(dst, 0, len * sizeof(int16_t));
+        return;
+    }
+    int16_t block[CODEC_BLOCK];
+    while (len > 0) {
+        size_t b = pos / CODEC_BLOCK;
+        size_t at = pos % CODEC_BLOCK;
+        size_t n = CODEC_BLOCK - at < len ? CODEC_BLOCK - at : len;
+        //whole blocks decode in place
+        if (at == 0 && n == CODEC_BLOCK) {
+            buf_decode(buf, b, dst);
+        } else {
+            buf_decode(buf, b, block);
+            memcpy(dst, block + at, n * sizeof(int16_t));
+        }
+        dst += n;
+        pos += n;
+        len -= n;
+    }
+}
+
+// unpack (or fill, if silent) a buffer to be written in place; false if out of memory
+static bool buf_thaw(sample_buf* buf) {
+    buf->used = true;
+    if (buf->samples) return true;
+    size_t capacity = arena_capacity(buf->length);
+    int16_t* samples = arena_alloc(capacity);
+    if (!samples) return false;
+    buf_unpack(buf, 0, buf->length, samples);
+    if (buf->packed) mem_free(buf->packed, buf->packed_len);
+    buf->packed = NULL;
+    buf->packed_len = 0;
+    buf->samples = samples;
+    buf->capacity = capacity;
+    return true;
+}
+
+// pack a buffer using scratch (room for the worst case), false if it would not shrink or memory ran out
+static bool buf_pack(sample_buf* buf, unsigned char* scratch) {
+    size_t blocks = codec_blocks(buf->length);
+    uint32_t* starts = (uint32_t*)scratch;
+    unsigned char* data = scratch + (blocks + 1) * sizeof(uint32_t);
+    size_t used = 0;
+    for (size_t b = 0; b < blocks; b++) {
+        size_t n = buf->length - b * CODEC_BLOCK < CODEC_BLOCK ? buf->length - b * CODEC_BLOCK : CODEC_BLOCK;
+        starts[b] = (uint32_t)used;
+        used += codec_encode_block(buf->samples + b * CODEC_BLOCK, n, data + used);
+    }
+    starts[blocks] = (uint32_t)used;
+
+    //worth it only if a tenth of the memory goes
+    size_t packed_len = (blocks + 1) * sizeof(uint32_t) + used + CODEC_PAD;
+    if (packed_len > buf->capacity * sizeof(int16_t) / 10 * 9) return false;
+    unsigned char* packed = (unsigned char*)mem_alloc(packed_len);
+    if (!packed) return false;
+    memcpy(packed, scratch, packed_len - CODEC_PAD);
+    memset(packed + packed_len - CODEC_PAD, 0, CODEC_PAD);
+    arena_free(buf->samples, buf->capacity);
+    buf->samples = NULL;
+    buf->capacity = 0;
+    buf->packed = packed;
+    buf->packed_len = packed_len;
+    buf->packings++;
+    return true;
+}
+
+// Pack the buffers of a track not used since the last call
+bool tr_compress_cold(struct sound_seg* track) {
+    if (!track) return false;
+
+    //visit each buffer once, viewers marks the visited ones
+    size_t longest = 0;
+    for (seg_node* node = track->head; node; node = node->next) {
+        if (!node->buf) continue;
+        node->buf->viewers = 0;
+        if (node->buf->samples && node->buf->length > longest) longest = node->buf->length;
+    }
+    size_t blocks = codec_blocks(longest);
+    //a block overshoots by a few bytes before it falls back to verbatim
+    size_t scratch_len = (blocks + 1) * sizeof(uint32_t) + blocks * (1 + CODEC_BLOCK * sizeof(int16_t)) + 2 * CODEC_PAD;
+    unsigned char* scratch = (unsigned char*)mem_alloc(scratch_len);
+    if (!scratch) return false;
+
+    for (seg_node* node = track->head; node; node = node->next) {
+        sample_buf* buf = node->buf;
+        if (!buf || buf->viewers) continue;
+        buf->viewers = 1;
+        //a buffer used since the last call gets another round
+        if (buf->used) {
+            buf->used = false;
+        } else if (buf->samples && !buf->map && buf->length >= CODEC_MIN_LEN) {
+            buf_pack(buf, scratch);
+        }
+    }
+    mem_free(scratch, scratch_len);
+    return true;
+}
+
+/*
+    compaction
+    edits leave runs of small nodes behind. compaction merges neighbours that
+    view consecutive ranges of one buffer (no samples move), and copies runs
+    of small nodes into one buffer when every view of their buffers is in
+    this track and the views of each buffer are all owned (no insert sees
+    them) or all shared (no owner writes to them anymore, e.g. the source
+    track is gone). a run is all owned or all shared and the copy keeps
+    that: a shared copy still gets its own buffer on a write, so copies
+    inserted from it later keep the old samples as they would have. other
+    buffers stay put, so writes still reach the inserted copies. a silent
+    buffer whose views are all movable turns back into plain silence, which
+    keeps its owned or shared kind.
+*/
+
+// longest run of nodes copied into one buffer
+#define COMPACT_MAX_RUN ((size_t)1 << 16)
+// auto compaction leaves tracks with fewer nodes alone
+#define COMPACT_MIN_NODES 64
+
+// count the track's views of each buffer
+static void compact_count(sound_seg* track) {
+    for (seg_node* node = track->head; node; node = node->next) {
+        if (!node->buf) continue;
+        node->buf->owners = 0;
+        node->buf->viewers = 0;
+    }
+    for (seg_node* node = track->head; node; node = node->next) {
+        if (!node->buf) continue;
+        if (node->shared) {
+            node->buf->viewers++;
+        } else {
+            node->buf->owners++;
+        }
+    }
+}
+
+// true if node's samples can move to another buffer unseen
+static bool node_movable(const seg_node* node) {
+    const sample_buf* buf = node->buf;
+    return buf && buf->owners + buf->viewers == buf->refs && (buf->owners == 0 || buf->viewers == 0);
+}
+
+// take node off the counts of its buffer
+static void compact_uncount(seg_node* node) {
+    if (!node->buf) return;
+    if (node->shared) {
+        node->buf->viewers--;
+    } else {
+        node->buf->owners--;
+    }
+}
+
+// free a node tr_compact merged away
+static void compact_drop(sound_seg* track, seg_node* node) {
+    compact_uncount(node);
+    idx_remove(track, node);
+    node_free(track, node);
+}
+
+// an unlinked node of track holding a copy of len samples, or silence if samples is NULL
+static seg_node* compact_piece(sound_seg* track, const int16_t* samples, size_t len) {
+    sample_buf* buf = NULL;
+    if (samples) {
+        buf = buf_new(len);
+        if (!buf) return NULL;
+        memcpy(buf->samples, samples, len * sizeof(int16_t));
+    }
+    seg_node* piece = node_new(track, buf, 0, len);
+    if (!piece) buf_release(buf);
+    return piece;
+}
+
+// replace a movable node holding zero runs of at least min samples by silent
+// nodes for the runs and copies of the rest; false if out of memory (nothing changes then)
+static bool compact_silence_node(sound_seg* track, seg_node* node, size_t min) {
+    const int16_t* x = node_samples(node);
+    size_t n = node->length;
+    seg_node* pieces = NULL;
+    seg_node* last = NULL;
+    size_t done = 0;
+    while (done < n) {
+        //the next zero run of min samples or more, [start, end)
+        size_t start = done;
+        size_t end = n;
+        while (start < n) {
+            if (x[start] != 0) {
+                start++;
+                continue;
+            }
+            end = start;
+            while (end < n && x[end] == 0) end++;
+            if (end - start >= min) break;
+            start = end;
+        }
+        if (start == n) end = n;
+        //no run at all: the node stays as it is
+        if (done == 0 && start == n) return true;
+
+        //the samples before the run, then the run
+        for (int k = 0; k < 2; k++) {
+            size_t len = k == 0 ? start - done : end - start;
+            if (len == 0) continue;
+            seg_node* piece = compact_piece(track, k == 0 ? x + done : NULL, len);
+            if (!piece) {
+                node_free_list(track, pieces);
+                return false;
+            }
+            //a shared node's pieces stay shared, copies inserted from them must not follow later writes
+            piece->shared = node->shared;
+            piece->next = NULL;
+            if (last) {
+                last->next = piece;
+            } else {
+                pieces = piece;
+            }
+            last = piece;
+        }
+        done = end;
+    }
+
+    seg_node* at = node;
+    while (pieces) {
+        seg_node* piece = pieces;
+        pieces = piece->next;
+        idx_insert_after(track, at, piece);
+        at = piece;
+    }
+    compact_drop(track, node);
+    return true;
+}
+
+// Merge adjacent nodes of a track
+bool tr_compact(struct sound_seg* track) {
+    if (!track) return false;
+    track->version++;
+
+    //long zero runs in movable nodes become silence first
+    if (track->silence_min_len > 0) {
+        compact_count(track);
+        seg_node* node = track->head;
+        while (node) {
+            seg_node* next = node->next;
+            if (node->length >= track->silence_min_len && node_movable(node) && node->buf->samples &&
+                !compact_silence_node(track, node, track->silence_min_len)) return false;
+            node = next;
+        }
+    }
+
+    compact_count(track);
+
+    //silence no other track views needs no buffer
+    for (seg_node* node = track->head; node; node = node->next) {
+        if (node_movable(node) && buf_silent(node->buf)) {
+            compact_uncount(node);
+            buf_release(node->buf);
+            node->buf = NULL;
+            node->offset = 0;
+        }
+    }
+
+    seg_node* node = track->head;
+    while (node) {
+        seg_node* next = node->next;
+
+        //an empty node holds nothing
+        if (node->length == 0) {
+            compact_drop(track, node);
+            node = next;
+            continue;
+        }
+        if (next && next->length == 0) {
+            compact_drop(track, next);
+            continue;
+        }
+
+        //neighbouring silence of one kind becomes one silent node
+        if (next && !node->buf && !next->buf && next->shared == node->shared) {
+            node->length += next->length;
+            idx_fix_path(node);
+            compact_drop(track, next);
+            continue;
+        }
+
+        //views of consecutive ranges of one buffer become one view
+        if (next && next->buf == node->buf && next->shared == node->shared &&
+            node->offset + node->length == next->offset) {
+            node->length += next->length;
+            idx_fix_path(node);
+            compact_drop(track, next);
+            continue;
+        }
+
+        //a run of movable nodes, all owned or all shared, goes into one buffer
+        size_t run_len = node->length;
+        seg_node* end = next;
+        while (end && node_movable(end) && end->shared == node->shared && run_len + end->length <= COMPACT_MAX_RUN) {
+            run_len += end->length;
+            end = end->next;
+        }
+        if (end == next || !node_movable(node)) {
+            node = next;
+            continue;
+        }
+
+        sample_buf* buf = node->buf;
+        if (buf->refs == 1 && !node->shared) {
+            //the node is the only view, its buffer grows from the end of the node
+            if (!buf_thaw(buf)) return false;
+            buf->length = node->offset + node->length;
+            if (!buf_reserve(buf, node->offset + run_len)) return false;
+        } else {
+            buf = buf_new(run_len);
+            if (!buf) return false;
+            buf->length = node->length;
+            buf_unpack(node->buf, node->offset, node->length, buf->samples);
+            compact_uncount(node);
+            buf_release(node->buf);
+            node->buf = buf;
+            node->offset = 0;
+            if (node->shared) {
+                buf->viewers = 1;
+            } else {
+                buf->owners = 1;
+            }
+        }
+        while (node->next != end) {
+            seg_node* merged = node->next;
+            buf_unpack(merged->buf, merged->offset, merged->length, buf->samples + buf->length);
+            buf->length += merged->length;
+            node->length += merged->length;
+            compact_drop(track, merged);
+        }
+        idx_fix_path(node);
+        node = end;
+    }
+    return true;
+}
+
+// Set the average node length below which edits compact the track
+void tr_set_auto_compact(struct sound_seg* track, size_t min_node_len) {
+    if (!track) return;
+    track->compact_min_len = min_node_len;
+    track->compact_floor = 0;
+}
+
+// compact after an edit if the track's nodes got too small on average
+static void compact_auto(sound_seg* track) {
+    if (track->compact_min_len == 0 || track->nodes < COMPACT_MIN_NODES) return;
+    if (track->nodes < track->compact_floor) return;
+    if (track->length / track->nodes >= track->compact_min_len) return;
+    tr_compact(track);
+    //nodes that could not merge (shared views) must double before the next try
+    track->compact_floor = 2 * track->nodes;
+}
+
+/*
+    silence
+    a silent node has a length but no buffer (buf is NULL): it reads as
+    zeros and costs a node whatever its length. tr_fill_silence writes one
+    directly; with tr_set_silence_detect, tr_write stores long runs of zeros
+    it is given that way and tr_compact converts the ones already stored.
+    like any write, making a range silent keeps it visible to inserted
+    copies: an owned range that other nodes may view is zeroed in place.
+    the other way round, inserting owned silence gives it a silent buffer
+    (no samples) the copies view, and a write fills that buffer in place,
+    so silence behaves like the zeros it stands for. a shared silent node
+    stands for zeros of a buffer no one writes to anymore: copies inserted
+    from it are shared silence too.
+*/
+
+// zeros the span iterator hands out for silence
+#define SILENCE_SPAN 4096
+static const int16_t silence_samples[SILENCE_SPAN];
+
+// merge a silent node into the silent node before it, returns the node that remains
+static seg_node* silence_merge(sound_seg* track, seg_node* node) {
+    seg_node* prev = node->prev;
+    if (!prev || prev->buf || node->buf || prev->shared != node->shared) return node;
+    prev->length += node->length;
+    idx_fix_path(prev);
+    idx_remove(track, node);
+    node_free(track, node);
+    return prev;
+}
+
+// make track[pos, pos + len) silent (pos <= length), extending the track past its end; false if out of memory
+static bool track_fill_silence(sound_seg* track, size_t pos, size_t len) {
+    size_t done = 0;
+    seg_node* last = NULL;
+    if (pos < track->length) {
+        size_t segStart = 0;
+        seg_node* curr = idx_find(track, pos, &segStart);
+        size_t offsetInNode = pos - segStart;
+        while (curr && done < len) {
+            size_t n = curr->length - offsetInNode;
+            if (n > len - done) n = len - done;
+            if (curr->buf && !curr->shared && curr->buf->refs > 1) {
+                //inserted copies may view the owner's samples, they must see the zeros
+                if (!buf_silent(curr->buf)) {
+                    if (!buf_thaw(curr->buf)) return false;
+                    memset(node_samples(curr) + offsetInNode, 0, n * sizeof(int16_t));
+                }
+            } else if (curr->buf || curr->shared) {
+                //cut out the range and drop its samples
+                if (offsetInNode > 0) {
+                    curr = node_split(track, curr, offsetInNode);
+                    if (!curr) return false;
+                }
+                if (n < curr->length && !node_split(track, curr, n)) return false;
+                buf_release(curr->buf);
+                curr->buf = NULL;
+                curr->offset = 0;
+                curr->shared = false;
+                curr = silence_merge(track, curr);
+            }
+            last = curr;
+            done += n;
+            offsetInNode = 0;
+            curr = curr->next;
+        }
+    }
+    if (last && last->next) silence_merge(track, last->next);
+
+    //the rest extends the track
+    if (done < len) {
+        seg_node* tail = track->tail;
+        if (tail && !tail->buf && !tail->shared) {
+            tail->length += len - done;
+            idx_fix_path(tail);
+        } else {
+            seg_node* node = node_new(track, NULL, 0, len - done);
+            if (!node) return false;
+            idx_insert_after(track, tail, node);
+        }
+        track->length += len - done;
+    }
+    return true;
+}
+
+// Write len samples of silence from position pos
+bool tr_fill_silence(struct sound_seg* track, size_t pos, size_t len) {
+    if (!track) return false;
+    if (pos > track->length) pos = track->length;
+    track->version++;
+    bool ok = track_fill_silence(track, pos, len);
+    compact_auto(track);
+    return ok;
+}
+
+// Set the zero run length tr_write and tr_compact store as silence
+void tr_set_silence_detect(struct sound_seg* track, size_t min_len) {
+    if (!track) return;
+    track->silence_min_len = min_len;
+}
+
+/*
+    mapped files
+    wav_map maps a whole WAV file read-only and makes its data chunk the
+    buffer of one shared node, so the samples are paged in from the page
+    cache as they are read. like any shared node, an edited range is copied
+    first; the file is unmapped when the last node viewing it goes.
+*/
+
+// little-endian fields of a RIFF header
+static uint32_t riff_u32(const unsigned char* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t riff_u16(const unsigned char* p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+// the rate tracks hold
+#define TRACK_RATE 8000
+
+// the fields of a fmt chunk the library looks at
+typedef struct {
+    uint16_t format; // 1: integer PCM, 3: IEEE float
+    uint16_t channels;
+    uint32_t rate;
+    uint16_t bits;
+} wav_format;
+
+// bytes of a fmt chunk wav_parse_fmt looks at, with the extensible format's subformat
+#define WAV_FMT_MAX 40
+
+// parse a fmt chunk of len bytes (at least 16)
+static void wav_parse_fmt(const unsigned char* p, size_t len, wav_format* fmt) {
+    fmt->format = riff_u16(p);
+    fmt->channels = riff_u16(p + 2);
+    fmt->rate = riff_u32(p + 4);
+    fmt->bits = riff_u16(p + 14);
+    //WAVE_FORMAT_EXTENSIBLE: the real format code starts the subformat GUID
+    if (fmt->format == 0xFFFE && len >= 26) fmt->format = riff_u16(p + 24);
+}
+
+// true if the samples are stored the way tracks hold them: 8000 Hz 16-bit mono PCM
+static bool wav_format_native(const wav_format* fmt) {
+    return fmt->format == 1 && fmt->channels == 1 && fmt->bits == 16 && fmt->rate == TRACK_RATE;
+}
+
+// find the data chunk of a file in the native format, false if it is not one
+static bool wav_find_data(const unsigned char* file, size_t size, size_t* data_pos, size_t* data_len) {
+    if (size < 12 || memcmp(file, "RIFF", 4) != 0 || memcmp(file + 8, "WAVE", 4) != 0) return false;
+
+    bool pcm16 = false;
+    size_t pos = 12;
+    while (size - pos >= 8) {
+        const unsigned char* chunk = file + pos;
+        size_t len = riff_u32(chunk + 4);
+        pos += 8;
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            if (len < 16 || size - pos < 16) return false;
+            wav_format fmt;
+            wav_parse_fmt(file + pos, len < size - pos ? len : size - pos, &fmt);
+            pcm16 = wav_format_native(&fmt);
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!pcm16) return false;
+            //streamed files may leave the size unset, the data runs to the end then
+            if (len > size - pos) len = size - pos;
+            *data_pos = pos;
+            *data_len = len;
+            return true;
+        }
+        //chunks are padded to an even size
+        if (len > size - pos) return false;
+        pos += len + (len & 1);
+    }
+    return false;
+}
+
+// Load a WAV file as a track that reads the file's pages in place
+struct sound_seg* wav_map(const char* fname) {
+    if (!fname) return NULL;
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    //the pages are page aligned and chunks start at even offsets, so samples are aligned
+    size_t data_pos = 0;
+    size_t data_len = 0;
+    if (!wav_find_data((const unsigned char*)map, size, &data_pos, &data_len) || (data_pos & 1)) {
+        munmap(map, size);
+        //other formats are converted into memory
+        struct wav_reader* r = wav_open(fname);
+        if (!r) return NULL;
+        sound_seg* track = tr_init();
+        if (track) wav_read_track(r, track, SIZE_MAX);
+        wav_close(r);
+        return track;
+    }
+    size_t samples = data_len / sizeof(int16_t);
+    sound_seg* track = tr_init();
+    file_map* fm = track && samples > 0 ? (file_map*)mem_alloc(sizeof(file_map)) : NULL;
+    if (!fm) {
+        munmap(map, size);
+        if (track && samples > 0) {
+            tr_destroy(track);
+            return NULL;
+        }
+        return track;
+    }
+    fm->addr = map;
+    fm->len = size;
+    fm->refs = 1;
+
+    sample_buf* buf = buf_new_mapped(fm, (int16_t*)((unsigned char*)map + data_pos), samples);
+    seg_node* node = buf ? node_new(track, buf, 0, samples) : NULL;
+    if (buf && !node) buf_release(buf);
+    //the buffer holds the mapping now, if it was made
+    map_release(fm);
+    if (!node) {
+        tr_destroy(track);
+        return NULL;
+    }
+    node->shared = true;
+    idx_insert_after(track, NULL, node);
+    track->length = samples;
+    return track;
+}
+
+/*
+    format conversion
+    files that are not 8000 Hz 16-bit mono PCM are converted while they are
+    read, block by block: each block of frames is decoded and downmixed into
+    mono floats (int16 scale), resampled to 8000 Hz by a polyphase windowed
+    sinc filter, then rounded and saturated to int16. the filter is a Kaiser
+    window (80 dB stopband) whose transition band ends at the lower Nyquist
+    frequency, so nothing above 4000 Hz folds back into the result.
+    the inner loops (filter dot products, stereo 16-bit downmix, float to
+    int16) pick SIMD kernels on the first call, like the correlation kernels.
+*/
+
+// frames decoded per block
+#define CONVERT_BLOCK 4096
+// stopband attenuation of the resampling filter in dB
+#define CONVERT_ATTENUATION 80.0
+// the passband keeps this much of the lower Nyquist frequency
+#define CONVERT_PASSBAND 0.85
+
+typedef struct {
+    wav_format fmt;
+    size_t frame_bytes;
+    unsigned char* raw; // one block of frames as stored in the file
+    // mono input, in[0] is padded input index in_start (input m is padded index m + taps - 1)
+    float* in;
+    size_t in_len;
+    size_t in_cap;
+    uint64_t in_start;
+    uint64_t inputs; // input frames decoded so far
+    bool eof;
+    // output k is the dot of phase (k * down + center) % up with the taps inputs from
+    // padded index (k * down + center) / up; up == down == 1 means no resampling
+    size_t up;
+    size_t down;
+    size_t taps; // per phase, a multiple of 8
+    uint64_t center;
+    float* coef; // [up][taps]
+    uint64_t next; // next output
+    uint64_t end; // outputs in total, known at the end of the file
+    float* out; // one block of outputs before rounding
+} wav_convert;
+
+/*
+    conversion kernels
+*/
+
+typedef struct {
+    float (*dot)(const float* a, const float* b, size_t n); // n a multiple of 8
+    void (*to_int16)(const float* src, int16_t* dst, size_t n);
+    void (*stereo16)(const int16_t* src, float* dst, size_t frames); // average of the channels
+} conv_kernels;
+
+static float dotf_portable(const float* a, const float* b, size_t n) {
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (size_t i = 0; i < n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+// round to nearest even and saturate, the same as cvtps + packs
+static void to_int16_portable(const float* src, int16_t* dst, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        float v = src[i];
+        if (v >= 32767.0f) {
+            dst[i] = 32767;
+        } else if (v <= -32768.0f) {
+            dst[i] = -32768;
+        } else {
+            //adding 1.5 * 2^23 leaves the rounded value in the low mantissa bits
+            float shifted = v + 12582912.0f;
+            dst[i] = (int16_t)((int32_t)(shifted - 12582912.0f));
+        }
+    }
+}
+
+static void stereo16_portable(const int16_t* src, float* dst, size_t frames) {
+    for (size_t i = 0; i < frames; i++) {
+        dst[i] = ((float)src[2 * i] + (float)src[2 * i + 1]) * 0.5f;
+    }
+}
+
+#if defined(DOT_X86)
+__attribute__((target("sse2")))
+static float dotf_sse2(const float* a, const float* b, size_t n) {
+    __m128 s0 = _mm_setzero_ps();
+    __m128 s1 = _mm_setzero_ps();
+    for (size_t i = 0; i < n; i += 8) {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(s0, s1));
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+__attribute__((target("avx2,fma")))
+static float dotf_avx2(const float* a, const float* b, size_t n) {
+    __m256 s0 = _mm256_setzero_ps();
+    __m256 s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+    }
+    if (i < n) s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+    __m256 s = _mm256_add_ps(s0, s1);
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+    float lanes[4];
+    _mm_storeu_ps(lanes, h);
+    _mm256_zeroupper();
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+__attribute__((target("sse2")))
+static void to_int16_sse2(const float* src, int16_t* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        //cvtps rounds to nearest even, packs saturates (the float side first, so huge values do not wrap)
+        __m128 lo = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i), _mm_set1_ps(-32768.0f)), _mm_set1_ps(32767.0f));
+        __m128 hi = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + 4), _mm_set1_ps(-32768.0f)), _mm_set1_ps(32767.0f));
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+        _mm_storeu_si128((__m128i*)(dst + i), packed);
+    }
+    to_int16_portable(src + i, dst + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void stereo16_sse2(const int16_t* src, float* dst, size_t frames) {
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128 half = _mm_set1_ps(0.5f);
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        //madd with ones adds the left and right sample of each frame
+        __m128i sums = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(src + 2 * i)), ones);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(sums), half));
+    }
+    stereo16_portable(src + 2 * i, dst + i, frames - i);
+}
+#endif
+
+static conv_kernels conv_select(void) {
+    conv_kernels k = { dotf_portable, to_int16_portable, stereo16_portable };
+#if defined(DOT_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        k.dot = dotf_sse2;
+        k.to_int16 = to_int16_sse2;
+        k.stereo16 = stereo16_sse2;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) k.dot = dotf_avx2;
+#endif
+    return k;
+}
+
+static conv_kernels conv_kernel;
+static pthread_once_t conv_once = PTHREAD_ONCE_INIT;
+
+static void conv_init(void) {
+    conv_kernel = conv_select();
+}
+
+// picked once, tracks may be opened on several threads at once
+static const conv_kernels* conv_kernels_get(void) {
+    pthread_once(&conv_once, conv_init);
+    return &conv_kernel;
+}
+
+/*
+    filter design, without libm
+*/
+
+// sin(2 * pi * t): reduce to a quadrant, then Taylor series
+static double sin_turns(double t) {
+    t -= (double)(int64_t)t;
+    if (t < 0) t += 1.0;
+    int quadrant = (int)(t * 4.0);
+    if (quadrant > 3) quadrant = 3;
+    double x = 6.28318530717958647692 * (t - 0.25 * quadrant);
+    double x2 = x * x;
+    double cs = 1.0, sn = x;
+    double tc = 1.0, ts = x;
+    for (int i = 1; i <= 14; i++) {
+        tc *= -x2 / (double)((2 * i - 1) * (2 * i));
+        ts *= -x2 / (double)((2 * i) * (2 * i + 1));
+        cs += tc;
+        sn += ts;
+    }
+    switch (quadrant) {
+        case 0: return sn;
+        case 1: return cs;
+        case 2: return -sn;
+        default: return -cs;
+    }
+}
+
+// modified Bessel function I0 of x, from x^2 / 4
+static double bessel_i0(double quarter_x2) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 200 && term > sum * 1e-15; k++) {
+        term *= quarter_x2 / ((double)k * (double)k);
+        sum += term;
+    }
+    return sum;
+}
+
+static size_t gcd_size(size_t a, size_t b) {
+    while (b) {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// design the polyphase filter from rate to TRACK_RATE, false if out of memory
+static bool convert_design(wav_convert* cv, uint32_t rate) {
+    size_t g = gcd_size(TRACK_RATE, rate);
+    cv->up = TRACK_RATE / g;
+    cv->down = rate / g;
+    if (cv->up == 1 && cv->down == 1) {
+        cv->taps = 1;
+        cv->center = 0;
+        return true;
+    }
+
+    //all frequencies relative to the upsampled rate up * rate
+    double upsampled = (double)cv->up * (double)rate;
+    double nyquist = 0.5 * (double)(rate < TRACK_RATE ? rate : TRACK_RATE);
+    double stop = nyquist / upsampled;
+    double pass = CONVERT_PASSBAND * stop;
+    double cutoff = 0.5 * (pass + stop);
+    double width = 6.28318530717958647692 * (stop - pass);
+    double beta = 0.1102 * (CONVERT_ATTENUATION - 8.7);
+    size_t length = (size_t)((CONVERT_ATTENUATION - 7.95) / (2.285 * width)) + 1;
+
+    //whole phases of a multiple of 8 taps for the kernels
+    size_t taps = (length + cv->up - 1) / cv->up;
+    taps = (taps + 7) / 8 * 8;
+    length = taps * cv->up;
+    cv->taps = taps;
+    cv->center = length / 2;
+    cv->coef = (float*)malloc(length * sizeof(float));
+    if (!cv->coef) return false;
+
+    //phase r holds taps r, r + up, ... reversed, to line up with the inputs in order
+    double half = 0.5 * (double)(length - 1);
+    double norm = bessel_i0(beta * beta / 4.0);
+    for (size_t r = 0; r < cv->up; r++) {
+        double sum = 0.0;
+        double* h = (double*)malloc(taps * sizeof(double));
+        if (!h) return false;
+        for (size_t j = 0; j < taps; j++) {
+            double t = (double)(r + j * cv->up) - half;
+            double sinc = t == 0.0 ? 2.0 * cutoff : sin_turns(cutoff * t) / (3.14159265358979323846 * t);
+            double x = t / half;
+            double window = bessel_i0(beta * beta * (1.0 - x * x) / 4.0) / norm;
+            h[j] = sinc * window;
+            sum += h[j];
+        }
+        //each phase passes DC with gain 1
+        for (size_t j = 0; j < taps; j++) {
+            cv->coef[r * taps + (taps - 1 - j)] = (float)(h[j] / sum);
+        }
+        free(h);
+    }
+    return true;
+}
+
+static void convert_free(wav_convert* cv) {
+    if (!cv) return;
+    free(cv->raw);
+    free(cv->in);
+    free(cv->coef);
+    free(cv->out);
+    free(cv);
+}
+
+// set up the conversion of a format, NULL if it is not supported or out of memory
+static wav_convert* convert_new(const wav_format* fmt) {
+    bool pcm = fmt->format == 1 && (fmt->bits == 8 || fmt->bits == 16 || fmt->bits == 24 || fmt->bits == 32);
+    bool ieee = fmt->format == 3 && (fmt->bits == 32 || fmt->bits == 64);
+    if ((!pcm && !ieee) || fmt->channels == 0 || fmt->rate == 0) return NULL;
+
+    wav_convert* cv = (wav_convert*)calloc(1, sizeof(wav_convert));
+    if (!cv) return NULL;
+    cv->fmt = *fmt;
+    cv->frame_bytes = (size_t)fmt->channels * (fmt->bits / 8);
+    cv->end = UINT64_MAX;
+    if (!convert_design(cv, fmt->rate)) {
+        convert_free(cv);
+        return NULL;
+    }
+    cv->in_cap = cv->taps - 1 + CONVERT_BLOCK + cv->taps;
+    cv->raw = (unsigned char*)malloc(CONVERT_BLOCK * cv->frame_bytes);
+    cv->in = (float*)calloc(cv->in_cap, sizeof(float));
+    cv->out = (float*)malloc(CONVERT_BLOCK * sizeof(float));
+    if (!cv->raw || !cv->in || !cv->out) {
+        convert_free(cv);
+        return NULL;
+    }
+    //inputs before the first one read as 0
+    cv->in_len = cv->taps - 1;
+    return cv;
+}
+
+// decode frames of raw into mono floats at int16 scale
+static void convert_decode(const wav_convert* cv, const unsigned char* raw, size_t frames, float* dst) {
+    const wav_format* fmt = &cv->fmt;
+    size_t channels = fmt->channels;
+    float scale = 1.0f / (float)channels;
+
+    if (fmt->format == 1 && fmt->bits == 16 && channels <= 2) {
+        if (channels == 2) {
+            conv_kernels_get()->stereo16((const int16_t*)raw, dst, frames);
+        } else {
+            const int16_t* src = (const int16_t*)raw;
+            for (size_t i = 0; i < frames; i++) dst[i] = (float)src[i];
+        }
+        return;
+    }
+    if (fmt->format == 3 && fmt->bits == 32) {
+        const float* src = (const float*)raw;
+        for (size_t i = 0; i < frames; i++) {
+            float sum = 0.0f;
+            for (size_t c = 0; c < channels; c++) sum += src[i * channels + c];
+            dst[i] = sum * scale * 32768.0f;
+        }
+        return;
+    }
+
+    size_t width = fmt->bits / 8;
+    for (size_t i = 0; i < frames; i++) {
+        double sum = 0.0;
+        for (size_t c = 0; c < channels; c++) {
+            const unsigned char* p = raw + (i * channels + c) * width;
+            switch (fmt->format == 3 ? 64 + fmt->bits : fmt->bits) {
+                case 8: sum += ((int)p[0] - 128) * 256.0; break;
+                case 16: sum += (int16_t)riff_u16(p); break;
+                //sign extend the 24-bit value, then scale to 16 bits
+                case 24: sum += (double)((int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8) / 256.0; break;
+                case 32: sum += (double)(int32_t)riff_u32(p) / 65536.0; break;
+                default: {
+                    double v;
+                    memcpy(&v, p, sizeof(double));
+                    sum += v * 32768.0;
+                    break;
+                }
+            }
+        }
+        dst[i] = (float)(sum * scale);
+    }
+}
+
+// decode the next block of frames from f, at most *remaining bytes, false at the end
+static bool convert_fill(wav_convert* cv, FILE* f, uint64_t* remaining) {
+    //drop the inputs no later output needs
+    uint64_t first = (cv->next * cv->down + cv->center) / cv->up;
+    if (first > cv->in_start) {
+        size_t drop = (size_t)(first - cv->in_start);
+        if (drop > cv->in_len) drop = cv->in_len;
+        memmove(cv->in, cv->in + drop, (cv->in_len - drop) * sizeof(float));
+        cv->in_len -= drop;
+        cv->in_start += drop;
+    }
+
+    size_t frames = cv->in_cap - cv->in_len - cv->taps;
+    if (frames > CONVERT_BLOCK) frames = CONVERT_BLOCK;
+    uint64_t left = *remaining / cv->frame_bytes;
+    if (frames > left) frames = (size_t)left;
+    size_t got = frames ? fread(cv->raw, cv->frame_bytes, frames, f) : 0;
+    if (got < frames) {
+        *remaining = 0;
+    } else if (*remaining != UINT64_MAX) {
+        *remaining -= got * cv->frame_bytes;
+    }
+    if (got > 0) {
+        convert_decode(cv, cv->raw, got, cv->in + cv->in_len);
+        cv->in_len += got;
+        cv->inputs += got;
+        return true;
+    }
+
+    //the end: inputs after the last one read as 0
+    cv->eof = true;
+    memset(cv->in + cv->in_len, 0, cv->taps * sizeof(float));
+    cv->in_len += cv->taps;
+    cv->end = (cv->inputs * cv->up + cv->down - 1) / cv->down;
+    return false;
+}
+
+// convert up to n samples into dest
+static size_t convert_read(wav_convert* cv, FILE* f, uint64_t* remaining, int16_t* dest, size_t n) {
+    const conv_kernels* k = conv_kernels_get();
+    size_t produced = 0;
+    while (produced < n && cv->next < cv->end) {
+        //outputs whose inputs are all decoded: (next * down + center) / up + taps <= in_start + in_len
+        uint64_t limit = cv->in_start + cv->in_len;
+        uint64_t ready = 0;
+        if (limit >= cv->taps) {
+            uint64_t last = ((limit - cv->taps + 1) * cv->up - 1);
+            ready = last >= cv->center ? (last - cv->center) / cv->down + 1 : 0;
+        }
+        if (ready > cv->end) ready = cv->end;
+        if (ready <= cv->next) {
+            if (cv->eof) break;
+            convert_fill(cv, f, remaining);
+            continue;
+        }
+
+        size_t count = (size_t)(ready - cv->next);
+        if (count > n - produced) count = n - produced;
+        if (count > CONVERT_BLOCK) count = CONVERT_BLOCK;
+        if (cv->up == 1 && cv->down == 1) {
+            k->to_int16(cv->in + (cv->next - cv->in_start), dest + produced, count);
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                uint64_t pos = (cv->next + i) * cv->down + cv->center;
+                const float* coef = cv->coef + (pos % cv->up) * cv->taps;
+                cv->out[i] = k->dot(coef, cv->in + (pos / cv->up - cv->in_start), cv->taps);
+            }
+            k->to_int16(cv->out, dest + produced, count);
+        }
+        cv->next += count;
+        produced += count;
+    }
+    return produced;
+}
+
+/*
+    streaming reader
+    wav_open walks the RIFF chunks up to the data chunk, remembering the
+    format, and stops there; reads then take samples from the data chunk
+    only, through a large stdio buffer, so trailing chunks are never read as
+    audio and memory stays bounded whatever the file size. other formats go
+    through the converter above.
+*/
+
+struct wav_reader {
+    FILE* f;
+    char* io; // stdio buffer
+    wav_format fmt;
+    wav_convert* convert; // NULL for files in the native format
+    uint64_t remaining; // bytes of the data chunk not read yet, UINT64_MAX: up to the end of the file
+};
+
+// skip n bytes of the file, false at the end
+static bool wav_skip(FILE* f, uint64_t n) {
+    return fseeko(f, (off_t)n, SEEK_CUR) == 0;
+}
+
+// Open a WAV file for reading
+struct wav_reader* wav_open(const char* fname) {
+    if (!fname) return NULL;
+    struct wav_reader* r = (struct wav_reader*)calloc(1, sizeof(struct wav_reader));
+    if (!r) return NULL;
+    r->f = fopen(fname, "rb");
+    if (!r->f) {
+        free(r);
+        return NULL;
+    }
+    r->io = malloc(WAV_IO_BUFFER);
+    if (r->io) setvbuf(r->f, r->io, _IOFBF, WAV_IO_BUFFER);
+
+    unsigned char head[12];
+    bool ok = fread(head, 1, 12, r->f) == 12 && memcmp(head, "RIFF", 4) == 0 && memcmp(head + 8, "WAVE", 4) == 0;
+    bool has_fmt = false;
+    while (ok) {
+        unsigned char chunk[8];
+        if (fread(chunk, 1, 8, r->f) != 8) {
+            ok = false;
+            break;
+        }
+        uint32_t len = riff_u32(chunk + 4);
+        if (memcmp(chunk, "data", 4) == 0) {
+            //streamed files may leave the size unset, the data runs to the end then
+            r->remaining = len == UINT32_MAX ? UINT64_MAX : len;
+            ok = has_fmt;
+            break;
+        }
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            unsigned char fmt[WAV_FMT_MAX];
+            uint32_t fmt_len = len < WAV_FMT_MAX ? len : WAV_FMT_MAX;
+            if (len < 16 || fread(fmt, 1, fmt_len, r->f) != fmt_len) {
+                ok = false;
+                break;
+            }
+            wav_parse_fmt(fmt, fmt_len, &r->fmt);
+            has_fmt = true;
+            len -= fmt_len;
+        }
+        //chunks are padded to an even size
+        ok = wav_skip(r->f, (uint64_t)len + (len & 1));
+    }
+
+    //anything else is converted as it is read
+    if (ok && !wav_format_native(&r->fmt)) {
+        r->convert = convert_new(&r->fmt);
+        ok = r->convert != NULL;
+    }
+    if (!ok) {
+        wav_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+// Read up to n samples from a reader into dest
+size_t wav_read(struct wav_reader* r, int16_t* dest, size_t n) {
+    if (!r || !dest) return 0;
+    if (r->convert) return convert_read(r->convert, r->f, &r->remaining, dest, n);
+    uint64_t left = r->remaining / sizeof(int16_t);
+    if (n > left) n = (size_t)left;
+    size_t got = fread(dest, sizeof(int16_t), n, r->f);
+    if (got < n) {
+        r->remaining = 0;
+    } else if (r->remaining != UINT64_MAX) {
+        r->remaining -= got * sizeof(int16_t);
+    }
+    return got;
+}
+
+// Read up to n samples from a reader onto the end of a track
+size_t wav_read_track(struct wav_reader* r, struct sound_seg* track, size_t n) {
+    if (!r || !track) return 0;
+    track->version++;
+    size_t total = 0;
+    while (total < n) {
+        size_t want = n - total < WAV_TRACK_BLOCK ? n - total : WAV_TRACK_BLOCK;
+        //read straight into the track's last buffer
+        int16_t* space = track_append_space(track, want);
+        if (!space) break;
+        size_t got = wav_read(r, space, want);
+        track_append_commit(track, got);
+        total += got;
+        if (got < want) break;
+    }
+    compact_auto(track);
+    return total;
+}
+
+// Close a reader
+void wav_close(struct wav_reader* r) {
+    if (!r) return;
+    if (r->f) fclose(r->f);
+    convert_free(r->convert);
+    free(r->io);
+    free(r);
+}
+
+/*
+    span iterator
+    walks a range of a track as contiguous runs of samples in the buffers of
+    the nodes that hold them. packed buffers are decoded a block at a time
+    into the iterator, so such a run is valid only until the next call.
+    silence comes as runs of static zeros, or, for callers that set sparse,
+    as one NULL run per silent stretch.
+*/
+
+typedef struct {
+    seg_node* node;
+    size_t offset; // position inside node
+    size_t remaining; // samples left in the range
+    bool touch; // mark the buffers read as used
+    bool sparse; // silent runs come back whole with NULL samples
+    const sample_buf* block_buf; // the packed buffer block was decoded from
+    size_t block_index;
+    unsigned block_packing; // and the packing of the buffer it came from
+    int16_t block[CODEC_BLOCK];
+} span_iter;
+
+// start walking track[pos, pos + len), the range must lie inside the track
+static void span_begin(span_iter* it, const sound_seg* track, size_t pos, size_t len) {
+    size_t segStart = 0;
+    it->node = len > 0 ? idx_find(track, pos, &segStart) : NULL;
+    it->offset = pos - segStart;
+    it->remaining = it->node ? len : 0;
+    it->touch = false;
+    it->sparse = false;
+    it->block_buf = NULL;
+    it->block_index = 0;
+    it->block_packing = 0;
+}
+
+// true if a run span_next gave lies in the iterator's decoded block
+static bool span_transient(const span_iter* it, const int16_t* samples) {
+    return samples >= it->block && samples < it->block + CODEC_BLOCK;
+}
+
+// next run of samples, false at the end of the range
+static bool span_next(span_iter* it, const int16_t** samples, size_t* len) {
+    while (it->remaining > 0 && it->node) {
+        seg_node* node = it->node;
+        size_t n = node->length - it->offset;
+        if (n > it->remaining) n = it->remaining;
+        sample_buf* buf = node->buf;
+        if (!buf || buf_silent(buf)) {
+            if (!it->sparse && n > SILENCE_SPAN) n = SILENCE_SPAN;
+            *samples = it->sparse ? NULL : silence_samples;
+        } else if (buf->packed) {
+            //up to the end of the block holding the next sample
+            size_t at = node->offset + it->offset;
+            if (it->block_buf != buf || it->block_index != at / CODEC_BLOCK || it->block_packing != buf->packings) {
+                buf_decode(buf, at / CODEC_BLOCK, it->block);
+                it->block_buf = buf;
+                it->block_index = at / CODEC_BLOCK;
+                it->block_packing = buf->packings;
+            }
+            if (n > CODEC_BLOCK - at % CODEC_BLOCK) n = CODEC_BLOCK - at % CODEC_BLOCK;
+            *samples = it->block + at % CODEC_BLOCK;
+        } else {
+            if (it->touch) buf->used = true;
+            *samples = node_samples(node) + it->offset;
+        }
+        *len = n;
+        it->remaining -= n;
+        it->offset += n;
+        if (it->offset == node->length) {
+            it->node = node->next;
+            it->offset = 0;
+        }
+        if (n > 0) return true;
+    }
+    return false;
+}
+
+// copy the rest of an iterator's range to dest, marking the buffers read as used
+static void span_copy(span_iter* it, int16_t* dest) {
+    const int16_t* samples;
+    size_t n;
+    it->touch = true;
+    it->sparse = true;
+    while (span_next(it, &samples, &n)) {
+        if (samples) {
+            memcpy(dest, samples, n * sizeof(int16_t));
+        } else {
+            memset(dest, 0, n * sizeof(int16_t));
+        }
+        dest += n;
+    }
+}
+
+// Read len elements from position pos into dest (e in pos-> pos + len copy)
+void tr_read(struct sound_seg* track, int16_t* dest, size_t pos, size_t len) {
+    //check if track samples and dest is null
+    if (!track || !dest) return;
+    if (pos >= track->length) return;
+    if (len > track->length - pos) len = track->length - pos;
+
+    span_iter it;
+    span_begin(&it, track, pos, len);
+    span_copy(&it, dest);
+}
+
+/*
+    read cursor
+    a position in a track that remembers the node it lies in and the block it
+    last decoded, so a read that goes on where the previous one stopped needs
+    no index lookup. every edit bumps the track's version, and the next read
+    then finds the node again.
+*/
+
+struct tr_cursor {
+    sound_seg* track;
+    size_t pos;
+    size_t version; // track->version it.node was found at
+    span_iter it; // node and offset of pos (node NULL: not found yet)
+};
+
+struct tr_cursor* tr_cursor_open(struct sound_seg* track, size_t pos) {
+    if (!track) return NULL;
+    struct tr_cursor* cur = (struct tr_cursor*)mem_alloc(sizeof(struct tr_cursor));
+    if (!cur) return NULL;
+    cur->track = track;
+    cur->pos = pos;
+    cur->version = track->version;
+    span_begin(&cur->it, track, 0, 0);
+    return cur;
+}
+
+void tr_cursor_close(struct tr_cursor* cur) {
+    if (cur) mem_free(cur, sizeof(struct tr_cursor));
+}
+
+void tr_cursor_seek(struct tr_cursor* cur, size_t pos) {
+    if (!cur || pos == cur->pos) return;
+    cur->pos = pos;
+    cur->it.node = NULL;
+}
+
+size_t tr_cursor_tell(const struct tr_cursor* cur) {
+    return cur ? cur->pos : 0;
+}
+
+size_t tr_cursor_read(struct tr_cursor* cur, int16_t* dest, size_t len) {
+    if (!cur || !dest) return 0;
+    sound_seg* track = cur->track;
+    if (cur->pos >= track->length) return 0;
+    if (len > track->length - cur->pos) len = track->length - cur->pos;
+
+    span_iter* it = &cur->it;
+    if (cur->version != track->version) {
+        //the nodes changed, and a buffer a block came from may be gone
+        it->node = NULL;
+        it->block_buf = NULL;
+        cur->version = track->version;
+    }
+    if (!it->node) {
+        size_t segStart = 0;
+        it->node = idx_find(track, cur->pos, &segStart);
+        it->offset = cur->pos - segStart;
+    }
+    it->remaining = len;
+    span_copy(it, dest);
+    cur->pos += len;
+    return len;
+}
+
+// buffers gathered per writev call
+#if defined(IOV_MAX) && IOV_MAX < 256
+#define SAVE_IOV IOV_MAX
+#else
+#define SAVE_IOV 256
+#endif
+
+// write every buffer of iov, false on an error
+static bool write_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        //skip what went out, a short write can stop inside a buffer
+        size_t done = (size_t)written;
+        while (count > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return true;
+}
+
+// spans shorter than this are copied into the staging buffer instead of getting a buffer of their own
+#define SAVE_SMALL_SPAN 512
+// samples of the staging buffer
+#define SAVE_STAGE ((size_t)1 << 15)
+
+// Save a track to a WAV file straight from its nodes
+bool tr_save(struct sound_seg* track, const char* fname) {
+    if (!track || !fname) return false;
+    //write next to the file and rename over it, a track mapped from it keeps its pages
+    size_t name_len = strlen(fname);
+    char* tmp = (char*)malloc(name_len + 5);
+    if (!tmp) return false;
+    memcpy(tmp, fname, name_len);
+    memcpy(tmp + name_len, ".tmp", 5);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        free(tmp);
+        return false;
+    }
+
+    //the header, then the spans of the track gathered SAVE_IOV at a time;
+    //runs of short spans, and decoded ones, are packed into the staging buffer first
+    unsigned char header[WAV_HEADER_SIZE];
+    wav_header(header, track->length);
+    struct iovec iov[SAVE_IOV];
+    iov[0].iov_base = header;
+    iov[0].iov_len = WAV_HEADER_SIZE;
+    int count = 1;
+    int16_t* stage = malloc(SAVE_STAGE * sizeof(int16_t));
+    size_t staged = 0;
+
+    bool ok = true;
+    span_iter it;
+    const int16_t* samples;
+    size_t n;
+    span_begin(&it, track, 0, track->length);
+    while (ok && span_next(&it, &samples, &n)) {
+        bool transient = span_transient(&it, samples);
+        if (stage && (n < SAVE_SMALL_SPAN || transient)) {
+            if (staged + n > SAVE_STAGE) {
+                ok = write_all(fd, iov, count);
+                count = 0;
+                staged = 0;
+            }
+            int16_t* dst = stage + staged;
+            memcpy(dst, samples, n * sizeof(int16_t));
+            staged += n;
+            //consecutive staged spans share one buffer
+            if (count > 0 && (char*)iov[count - 1].iov_base + iov[count - 1].iov_len == (char*)dst) {
+                iov[count - 1].iov_len += n * sizeof(int16_t);
+                continue;
+            }
+            samples = dst;
+            transient = false;
+        }
+        iov[count].iov_base = (void*)samples;
+        iov[count].iov_len = n * sizeof(int16_t);
+        if (++count == SAVE_IOV || transient) {
+            ok = write_all(fd, iov, count);
+            count = 0;
+            staged = 0;
+        }
+    }
+    if (ok && count > 0) ok = write_all(fd, iov, count);
+    free(stage);
+    if (ok && fsync(fd) != 0) ok = false;
+    if (close(fd) != 0) ok = false;
+    if (ok) ok = rename(tmp, fname) == 0;
+    if (!ok) unlink(tmp);
+    free(tmp);
+    return ok;
+}
+
+/*
+    project files
+    tr_save_project writes a set of tracks as their node lists plus the
+    samples those nodes view, each viewed range of a buffer stored once
+    however many nodes (of however many tracks) view it. tr_load_project maps
+    the file copy-on-write and points new buffers into the mapping, so
+    loading costs O(nodes) whatever the amount of audio, pages are read in as
+    they are touched, and owned nodes still write in place, where the nodes
+    sharing their buffer see the writes, without the file ever changing.
+
+    layout (native byte order): project_header, one project_track per track,
+    one project_buffer per stored range, one project_node per node in track
+    order (silent ones name no buffer), then the samples of each range
+    starting on a PROJECT_ALIGN boundary
+*/
+
+#define PROJECT_MAGIC "SSEGPRJ1"
+#define PROJECT_ALIGN 64
+
+typedef struct {
+    char magic[8];
+    uint64_t tracks;
+    uint64_t buffers;
+    uint64_t nodes;
+} project_header;
+
+typedef struct {
+    uint64_t nodes; // the track's nodes follow the ones of the tracks before it
+    uint64_t length; // samples
+} project_track;
+
+typedef struct {
+    uint64_t offset; // bytes from the start of the file
+    uint64_t length; // samples
+} project_buffer;
+
+// the buffer of a silent node
+#define PROJECT_SILENCE UINT64_MAX
+
+typedef struct {
+    uint64_t buffer; // PROJECT_SILENCE for silence
+    uint64_t offset; // samples into the buffer
+    uint64_t length;
+    uint64_t shared;
+} project_node;
+
+// a range of a buffer that nodes view, stored as one project_buffer
+typedef struct {
+    const sample_buf* buf;
+    size_t start;
+    size_t end;
+} project_range;
+
+static int range_cmp(const void* a, const void* b) {
+    const project_range* x = (const project_range*)a;
+    const project_range* y = (const project_range*)b;
+    if (x->buf != y->buf) return (uintptr_t)x->buf < (uintptr_t)y->buf ? -1 : 1;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    return 0;
+}
+
+// the range holding a node's samples, key is a range of one sample
+static int range_find(const void* key, const void* elem) {
+    const project_range* k = (const project_range*)key;
+    const project_range* r = (const project_range*)elem;
+    if (k->buf != r->buf) return (uintptr_t)k->buf < (uintptr_t)r->buf ? -1 : 1;
+    if (k->start < r->start) return -1;
+    return k->start >= r->end ? 1 : 0;
+}
+
+// Save tracks with their sharing to a project file
+bool tr_save_project(const char* fname, struct sound_seg* const* tracks, size_t count) {
+    if (!fname || (!tracks && count > 0)) return false;
+
+    //the viewed range of every node, then the union of each buffer's ranges
+    size_t views = 0;
+    for (size_t t = 0; t < count; t++) {
+        if (!tracks[t]) return false;
+        views += tracks[t]->nodes;
+    }
+    project_range* ranges = (project_range*)malloc((views ? views : 1) * sizeof(project_range));
+    if (!ranges) return false;
+    size_t used = 0;
+    size_t nodes = 0;
+    for (size_t t = 0; t < count; t++) {
+        for (seg_node* node = tracks[t]->head; node; node = node->next) {
+            if (node->length > 0) nodes++;
+            if (node->length == 0 || !node->buf) continue;
+            ranges[used].buf = node->buf;
+            ranges[used].start = node->offset;
+            ranges[used].end = node->offset + node->length;
+            used++;
+        }
+    }
+    qsort(ranges, used, sizeof(project_range), range_cmp);
+    size_t buffers = 0;
+    for (size_t i = 0; i < used; i++) {
+        //overlapping and touching views of a buffer are stored together
+        if (buffers > 0 && ranges[buffers - 1].buf == ranges[i].buf && ranges[i].start <= ranges[buffers - 1].end) {
+            if (ranges[i].end > ranges[buffers - 1].end) ranges[buffers - 1].end = ranges[i].end;
+        } else {
+            ranges[buffers++] = ranges[i];
+        }
+    }
+
+    //header and tables in one block, padded to the first range's samples
+    size_t tables = sizeof(project_header) + count * sizeof(project_track) +
+                    buffers * sizeof(project_buffer) + nodes * sizeof(project_node);
+    size_t data = (tables + PROJECT_ALIGN - 1) / PROJECT_ALIGN * PROJECT_ALIGN;
+    unsigned char* meta = (unsigned char*)calloc(1, data);
+    if (!meta) {
+        free(ranges);
+        return false;
+    }
+    project_header* header = (project_header*)meta;
+    project_track* ptracks = (project_track*)(header + 1);
+    project_buffer* pbuffers = (project_buffer*)(ptracks + count);
+    project_node* pnodes = (project_node*)(pbuffers + buffers);
+    memcpy(header->magic, PROJECT_MAGIC, 8);
+    header->tracks = count;
+    header->buffers = buffers;
+    header->nodes = nodes;
+    uint64_t offset = data;
+    for (size_t b = 0; b < buffers; b++) {
+        pbuffers[b].offset = offset;
+        pbuffers[b].length = ranges[b].end - ranges[b].start;
+        offset += (pbuffers[b].length * sizeof(int16_t) + PROJECT_ALIGN - 1) / PROJECT_ALIGN * PROJECT_ALIGN;
+    }
+    size_t n = 0;
+    for (size_t t = 0; t < count; t++) {
+        ptracks[t].length = tracks[t]->length;
+        for (seg_node* node = tracks[t]->head; node; node = node->next) {
+            if (node->length == 0) continue;
+            if (node->buf) {
+                project_range key = { node->buf, node->offset, node->offset + 1 };
+                const project_range* r = (const project_range*)bsearch(&key, ranges, buffers, sizeof(project_range), range_find);
+                pnodes[n].buffer = (uint64_t)(r - ranges);
+                pnodes[n].offset = node->offset - r->start;
+            } else {
+                pnodes[n].buffer = PROJECT_SILENCE;
+                pnodes[n].offset = 0;
+            }
+            pnodes[n].length = node->length;
+            pnodes[n].shared = node->shared;
+            ptracks[t].nodes++;
+            n++;
+        }
+    }
+
+    //write next to the file and rename over it, so a project loaded from it keeps its pages
+    size_t name_len = strlen(fname);
+    char* tmp = (char*)malloc(name_len + 5);
+    int fd = -1;
+    if (tmp) {
+        memcpy(tmp, fname, name_len);
+        memcpy(tmp + name_len, ".tmp", 5);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    bool ok = fd >= 0;
+    if (ok) {
+        static const unsigned char pad[PROJECT_ALIGN];
+        struct iovec iov[SAVE_IOV];
+        iov[0].iov_base = meta;
+        iov[0].iov_len = data;
+        int iovs = 1;
+        int16_t block[CODEC_BLOCK];
+        for (size_t b = 0; ok && b < buffers; b++) {
+            const sample_buf* buf = ranges[b].buf;
+            size_t bytes = pbuffers[b].length * sizeof(int16_t);
+            if (!buf->samples) {
+                //packed and silent ranges are decoded and written a block at a time
+                for (size_t pos = ranges[b].start; ok && pos < ranges[b].end; pos += CODEC_BLOCK) {
+                    size_t n = ranges[b].end - pos < CODEC_BLOCK ? ranges[b].end - pos : CODEC_BLOCK;
+                    buf_unpack(buf, pos, n, block);
+                    iov[iovs].iov_base = block;
+                    iov[iovs].iov_len = n * sizeof(int16_t);
+                    ok = write_all(fd, iov, iovs + 1);
+                    iovs = 0;
+                }
+            } else {
+                iov[iovs].iov_base = (void*)(buf->samples + ranges[b].start);
+                iov[iovs].iov_len = bytes;
+                iovs++;
+            }
+            if (bytes % PROJECT_ALIGN) {
+                iov[iovs].iov_base = (void*)pad;
+                iov[iovs].iov_len = PROJECT_ALIGN - bytes % PROJECT_ALIGN;
+                iovs++;
+            }
+            if (iovs + 2 > SAVE_IOV) {
+                ok = write_all(fd, iov, iovs);
+                iovs = 0;
+            }
+        }
+        if (ok && iovs > 0) ok = write_all(fd, iov, iovs);
+        if (close(fd) != 0) ok = false;
+        if (ok) ok = rename(tmp, fname) == 0;
+        if (!ok) unlink(tmp);
+    }
+    free(tmp);
+    free(meta);
+    free(ranges);
+    return ok;
+}
+
+// true if the tables of a mapped project of size bytes are consistent
+static bool project_valid(const unsigned char* file, size_t size) {
+    if (size < sizeof(project_header)) return false;
+    const project_header* header = (const project_header*)file;
+    if (memcmp(header->magic, PROJECT_MAGIC, 8) != 0) return false;
+    size_t left = size - sizeof(project_header);
+    if (header->tracks > left / sizeof(project_track)) return false;
+    left -= header->tracks * sizeof(project_track);
+    if (header->buffers > left / sizeof(project_buffer)) return false;
+    left -= header->buffers * sizeof(project_buffer);
+    if (header->nodes > left / sizeof(project_node)) return false;
+
+    const project_track* tracks = (const project_track*)(header + 1);
+    const project_buffer* buffers = (const project_buffer*)(tracks + header->tracks);
+    const project_node* nodes = (const project_node*)(buffers + header->buffers);
+    for (uint64_t b = 0; b < header->buffers; b++) {
+        if (buffers[b].offset > size || (buffers[b].offset & 1) ||
+            buffers[b].length > (size - buffers[b].offset) / sizeof(int16_t)) return false;
+    }
+    uint64_t n = 0;
+    for (uint64_t t = 0; t < header->tracks; t++) {
+        if (tracks[t].nodes > header->nodes - n) return false;
+        uint64_t length = 0;
+        for (uint64_t end = n + tracks[t].nodes; n < end; n++) {
+            const project_node* node = &nodes[n];
+            if (node->buffer == PROJECT_SILENCE && node->length > 0) {
+                length += node->length;
+                continue;
+            }
+            if (node->buffer >= header->buffers || node->length == 0 ||
+                node->offset > buffers[node->buffer].length ||
+                node->length > buffers[node->buffer].length - node->offset) return false;
+            length += node->length;
+        }
+        if (length != tracks[t].length) return false;
+    }
+    return n == header->nodes;
+}
+
+// Load the tracks of a project file
+struct sound_seg** tr_load_project(const char* fname, size_t* count) {
+    if (!fname || !count) return NULL;
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    //private and writable: owned nodes write in place, into pages of their own
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    file_map* fm = project_valid((const unsigned char*)map, size) ? (file_map*)mem_alloc(sizeof(file_map)) : NULL;
+    if (!fm) {
+        munmap(map, size);
+        return NULL;
+    }
+    //the loader holds the mapping until the buffers do
+    fm->addr = map;
+    fm->len = size;
+    fm->refs = 1;
+
+    const project_header* header = (const project_header*)map;
+    const project_track* ptracks = (const project_track*)(header + 1);
+    const project_buffer* pbuffers = (const project_buffer*)(ptracks + header->tracks);
+    const project_node* pnodes = (const project_node*)(pbuffers + header->buffers);
+    size_t ntracks = (size_t)header->tracks;
+    sound_seg** tracks = (sound_seg**)calloc(ntracks ? ntracks : 1, sizeof(sound_seg*));
+    sample_buf** bufs = (sample_buf**)calloc(header->buffers ? header->buffers : 1, sizeof(sample_buf*));
+    bool ok = tracks && bufs;
+
+    size_t n = 0;
+    for (size_t t = 0; ok && t < ntracks; t++) {
+        sound_seg* track = tr_init();
+        tracks[t] = track;
+        ok = track != NULL;
+        for (size_t end = n + ptracks[t].nodes; ok && n < end; n++) {
+            const project_node* pn = &pnodes[n];
+            bool silent = pn->buffer == PROJECT_SILENCE;
+            sample_buf* buf = NULL;
+            if (!silent && bufs[pn->buffer]) {
+                buf = buf_ref(bufs[pn->buffer]);
+            } else if (!silent) {
+                const project_buffer* pb = &pbuffers[pn->buffer];
+                buf = buf_new_mapped(fm, (int16_t*)((unsigned char*)map + pb->offset), (size_t)pb->length);
+                bufs[pn->buffer] = buf;
+            }
+            seg_node* node = buf || silent ? node_new(track, buf, silent ? 0 : (size_t)pn->offset, (size_t)pn->length) : NULL;
+            if (!node) {
+                //a buffer no node took is freed here, later ones are never reached
+                if (buf) buf_release(buf);
+                ok = false;
+                break;
+            }
+            node->shared = pn->shared != 0;
+            idx_insert_after(track, track->tail, node);
+            track->length += node->length;
+        }
+    }
+
+    if (!ok && tracks) {
+        for (size_t t = 0; t < ntracks; t++) tr_destroy(tracks[t]);
+        free(tracks);
+        tracks = NULL;
+    }
+    free(bufs);
+    map_release(fm);
+    if (tracks) *count = ntracks;
+    return tracks;
+}
+
+// write src[0, len) at pos (pos <= length)
+static void track_write(sound_seg* track, const int16_t* src, size_t pos, size_t len) {
+    size_t totalWritten = 0;
+
+    //overwrite the existing samples from pos
+    if (pos < track->length) {
+        size_t segStart = 0;
+        seg_node* curr = idx_find(track, pos, &segStart);
+        size_t offsetInNode = pos - segStart;
+
+        while (curr && totalWritten < len) {
+            size_t toWrite = curr->length - offsetInNode;
+            if (toWrite > len - totalWritten) toWrite = len - totalWritten;
+
+            //check if the data is shared, silent, or packed with no other view to see the write
+            if (!curr->buf || curr->shared || (!curr->buf->samples && curr->buf->refs == 1)) {
+                //cut out the written range, the rest of the node stays as it was
+                if (offsetInNode > 0) {
+                    curr = node_split(track, curr, offsetInNode);
+                    if (!curr) return;
+                    offsetInNode = 0;
+                }
+                if (toWrite < curr->length && !node_split(track, curr, toWrite)) return;
+
+                //give the range a buffer of its own, the write fills all of it
+                sample_buf* copy = buf_new(toWrite);
+                if (!copy) return;
+                buf_release(curr->buf);
+                curr->buf = copy;
+                curr->offset = 0;
+                curr->shared = false;
+            } else if (!buf_thaw(curr->buf)) {
+                return;
+            }
+            memcpy(node_samples(curr) + offsetInNode, src + totalWritten, toWrite * sizeof(int16_t));
+
+            totalWritten += toWrite;
+            offsetInNode = 0;
+            curr = curr->next;
+        }
+    }
+
+    //if data is not written done, append the rest
+    if (totalWritten < len) {
+        size_t remaining = len - totalWritten;
+        int16_t* space = track_append_space(track, remaining);
+        if (!space) return;
+        memcpy(space, src + totalWritten, remaining * sizeof(int16_t));
+
+        //update the length of the track
+        track_append_commit(track, remaining);
+    }
+}
+
+// write src[0, len) at pos (pos <= length), runs of zeros long enough become silence
+static void track_write_runs(sound_seg* track, const int16_t* src, size_t pos, size_t len) {
+    size_t min = track->silence_min_len;
+    size_t done = 0;
+    for (size_t i = 0; min > 0 && i < len;) {
+        if (src[i] != 0) {
+            i++;
+            continue;
+        }
+        size_t end = i;
+        while (end < len && src[end] == 0) end++;
+        if (end - i >= min) {
+            if (i > done) track_write(track, src + done, pos + done, i - done);
+            if (pos + i > track->length || !track_fill_silence(track, pos + i, end - i)) return;
+            done = end;
+        }
+        i = end;
+    }
+    if (done < len) track_write(track, src + done, pos + done, len - done);
+}
+
+// Write len elements from src into position pos
+void tr_write(struct sound_seg* track, const int16_t* src, size_t pos, size_t len) {
+    if (!track || !src || len == 0) return;
+
+    // if position is greater than length, set pos as the end of the track
+    if (pos > track->length) pos = track->length;
+    track->version++;
+    track_write_runs(track, src, pos, len);
+    compact_auto(track);
+    return;
+}
+
+// delete [pos, pos + len), the range must lie inside the track
+static bool track_delete(sound_seg* track, size_t pos, size_t len) {
+    //nodes only view their buffers, so shared nodes can go like any other
+    size_t segStart = 0;
+    seg_node* node = idx_find(track, pos, &segStart);
+    size_t deleted = 0;
+    if (pos > segStart) {
+        size_t offsetInNode = pos - segStart;
+        if (offsetInNode + len < node->length) {
+            //inside one node: cut it so the range starts at a node
+            node = node_split(track, node, offsetInNode);
+            if (!node) return false;
+        } else {
+            //delete somewhere to tail: the node keeps viewing its head
+            deleted = node->length - offsetInNode;
+            node->length = offsetInNode;
+            idx_fix_path(node);
+            node = node->next;
+        }
+    }
+
+    while (node && deleted < len) {
+        size_t remaining = len - deleted;
+        if (node->length <= remaining) {
+            //delete hole node
+            seg_node* next = node->next;
+            deleted += node->length;
+            idx_remove(track, node);
+            node_free(track, node);
+            node = next;
+        } else {
+            //delete the head to somewhere: the node views the rest of its buffer
+            node->offset += remaining;
+            node->length -= remaining;
+            idx_fix_path(node);
+            deleted += remaining;
+        }
+    }
+    track->length -= len;
+    return true;
+}
+
+// Delete a range of elements from the track
+bool tr_delete_range(struct sound_seg* track, size_t pos, size_t len) {
+    //edge
+    if (!track || !track->head) return false;
+    if (pos >= track->length) return false;
+    if (pos + len > track->length) len = track->length - pos;
+    if (len == 0) return true;
+    track->version++;
+    if (!track_delete(track, pos, len)) return false;
+    compact_auto(track);
+    return true;
+}
+
+/*
+    ad identification
+    the scan walks the target offsets in order; an offset inside the last
+    match (offset <= last_matched_end) is skipped, every other offset whose
+    cross correlation reaches 0.95 x the ad's auto correlation is a match.
+    the direct path evaluates each offset; the fft path estimates a whole
+    block of offsets at once and only evaluates the ones that can be matches.
+*/
+
+// match starts found by a scan, in increasing order
+typedef struct {
+    size_t* starts;
+    size_t count;
+    size_t cap;
+} start_list;
+
+// append one match start, false if out of memory
+static bool start_list_add(start_list* list, size_t start) {
+    if (list->count == list->cap) {
+        size_t new_cap = list->cap ? list->cap * 2 : 16;
+        size_t* new_starts = (size_t*)realloc(list->starts, new_cap * sizeof(size_t));
+        if (!new_starts) return false;
+        list->starts = new_starts;
+        list->cap = new_cap;
+    }
+    list->starts[list->count++] = start;
+    return true;
+}
+
+// "start,end" lines returned by tr_identify
+typedef struct {
+    char* text;
+    size_t len;
+    size_t size;
+    size_t count;
+} match_text;
+
+// append one "start,end" pair, false if out of memory
+static bool match_text_add(match_text* out, size_t start, size_t end) {
+    //convert to str
+    char pair[64];
+    int written = snprintf(pair, sizeof(pair), "%s%zu,%zu", out->count > 0 ? "\n" : "", start, end);
+    if (written < 0 || written >= (int)sizeof(pair)) return false;
+
+    // check if has enough space
+    if (out->len + written >= out->size) {
+        size_t new_size = out->size * 2;
+        while (new_size <= out->len + written) {
+            new_size *= 2;
+        }
+        char* new_text = (char*)realloc(out->text, new_size);
+        if (!new_text) return false;
+        out->text = new_text;
+        out->size = new_size;
+    }
+    memcpy(out->text + out->len, pair, written + 1);
+    out->len += written;
+    out->count++;
+    return true;
+}
+
+/*
+    fft correlation (overlap-save)
+    the ad spectrum is computed once; each block of n target samples gives the
+    correlation at n - alen + 1 offsets with one forward and one inverse fft.
+    the ad is real, so two target blocks are packed into the real and
+    imaginary parts of one transform.
+    the estimates carry rounding error, so they only rule offsets out: an
+    offset further below the threshold than the error bound cannot match,
+    anything else is checked with cross_correlation, which keeps the result
+    identical to the direct path.
+*/
+
+// ads shorter than this are scanned directly
+#define FFT_MIN_AD_LEN 256
+// largest block the fft path picks on its own
+#define FFT_MAX_BLOCK ((size_t)1 << 18)
+
+typedef struct {
+    double re;
+    double im;
+} cpx;
+
+// transform of the ad, read-only while scanning
+typedef struct {
+    size_t n; // transform size, a power of 2
+    unsigned log2n;
+    size_t step; // offsets estimated per block
+    cpx* twiddle; // exp(-2*pi*i*k/n), k < n/2
+    bool own_twiddle; // false when shared by several ads
+    cpx* ad_spec; // conj(fft(ad)) / n
+    double ad_energy;
+    double slack; // error bound of an estimate is slack * |block| * |ad|
+} fft_plan;
+
+// cos and sin of 2*pi*k/n without libm: reduce to a quadrant, then Taylor series
+static void unit_root(size_t k, size_t n, double* c, double* s) {
+    size_t quadrant = (k * 4) / n;
+    double x = 1.57079632679489661923 * (double)(k * 4 - quadrant * n) / (double)n;
+    double x2 = x * x;
+    double cs = 1.0, sn = x;
+    double tc = 1.0, ts = x;
+    for (int i = 1; i <= 14; i++) {
+        tc *= -x2 / (double)((2 * i - 1) * (2 * i));
+        ts *= -x2 / (double)((2 * i) * (2 * i + 1));
+        cs += tc;
+        sn += ts;
+    }
+    switch (quadrant) {
+        case 0: *c = cs; *s = sn; break;
+        case 1: *c = -sn; *s = cs; break;
+        case 2: *c = -cs; *s = -sn; break;
+        default: *c = sn; *s = -cs; break;
+    }
+}
+
+// in-place radix-2 fft, the inverse is not scaled
+static void fft(cpx* x, const cpx* twiddle, size_t n, bool inverse) {
+    //bit reversal permutation
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j |= bit;
+        if (i < j) {
+            cpx t = x[i];
+            x[i] = x[j];
+            x[j] = t;
+        }
+    }
+    //butterflies
+    for (size_t len = 2; len <= n; len <<= 1) {
+        size_t half = len >> 1;
+        size_t stride = n / len;
+        for (size_t i = 0; i < n; i += len) {
+            for (size_t j = 0; j < half; j++) {
+                cpx w = twiddle[j * stride];
+                if (inverse) w.im = -w.im;
+                cpx* a = &x[i + j];
+                cpx* b = &x[i + j + half];
+                double re = b->re * w.re - b->im * w.im;
+                double im = b->re * w.im + b->im * w.re;
+                b->re = a->re - re;
+                b->im = a->im - im;
+                a->re += re;
+                a->im += im;
+            }
+        }
+    }
+}
+
+static void fft_plan_free(fft_plan* plan) {
+    if (plan->own_twiddle) free(plan->twiddle);
+    free(plan->ad_spec);
+}
+
+// log2 of the transform size for an ad: a larger block wastes fewer outputs
+// on the ad overlap, up to the cap and the target length
+static unsigned fft_log2_size(size_t alen, size_t tlen) {
+    size_t n = 1;
+    unsigned log2n = 0;
+    while (n < 2 * alen || (n < 8 * alen && n < FFT_MAX_BLOCK && n < tlen)) {
+        n <<= 1;
+        log2n++;
+    }
+    return log2n;
+}
+
+// twiddle factors of a size n transform, NULL if out of memory
+static cpx* fft_twiddles(size_t n) {
+    cpx* twiddle = malloc((n / 2) * sizeof(cpx));
+    if (!twiddle) return NULL;
+    for (size_t k = 0; k < n / 2; k++) {
+        double c, s;
+        unit_root(k, n, &c, &s);
+        twiddle[k].re = c;
+        twiddle[k].im = -s;
+    }
+    return twiddle;
+}
+
+// transform the ad at size 2^log2n, with shared twiddles or (NULL) its own; false if out of memory
+// allocate a plan for an ad of alen samples, ad_spec is left for the caller to fill; false if out of memory
+static bool fft_plan_alloc(fft_plan* plan, size_t alen, unsigned log2n, cpx* twiddle) {
+    size_t n = (size_t)1 << log2n;
+    plan->n = n;
+    plan->log2n = log2n;
+    plan->step = n - alen + 1;
+    plan->own_twiddle = !twiddle;
+    plan->twiddle = twiddle ? twiddle : fft_twiddles(n);
+    plan->ad_spec = malloc(n * sizeof(cpx));
+    if (!plan->twiddle || !plan->ad_spec) {
+        fft_plan_free(plan);
+        return false;
+    }
+    return true;
+}
+
+// turn the zero-padded ad loaded into ad_spec into its spectrum
+static void fft_plan_transform(fft_plan* plan) {
+    size_t n = plan->n;
+    fft(plan->ad_spec, plan->twiddle, n, false);
+    for (size_t i = 0; i < n; i++) {
+        plan->ad_spec[i].re /= (double)n;
+        plan->ad_spec[i].im = -plan->ad_spec[i].im / (double)n;
+    }
+}
+
+static bool fft_plan_init(fft_plan* plan, const int16_t* ad, size_t alen, unsigned log2n, cpx* twiddle) {
+    if (!fft_plan_alloc(plan, alen, log2n, twiddle)) return false;
+    for (size_t i = 0; i < plan->n; i++) {
+        plan->ad_spec[i].re = i < alen ? (double)ad[i] : 0.0;
+        plan->ad_spec[i].im = 0.0;
+    }
+    fft_plan_transform(plan);
+    plan->ad_energy = auto_correlation(ad, alen);
+
+    //rounding of the two transforms grows with log2(n), the exact check
+    //rounds once; both are kept far on the safe side
+    plan->slack = (double)(log2n + 4) * 1e-14 + 2.3e-16;
+    return true;
+}
+
+// one identify call, shared read-only by every scan
+typedef struct {
+    const int16_t* target; // target[0] is the sample at offset origin
+    size_t origin;
+    size_t tlen; // offset just past the last target sample
+    const int16_t* ad;
+    size_t alen;
+    double threshold;
+    const fft_plan* plan; // NULL: direct scan
+    bool overlap; // a match does not skip the offsets inside it
+    size_t limit; // the scan stops once it found this many matches, 0: no limit
+} ident_job;
+
+// sum of squares of the target samples at offsets [start, start + n), 0 past the end
+static double block_energy(const ident_job* job, size_t start, size_t n) {
+    int64_t energy = 0;
+    for (size_t i = start; i < start + n && i < job->tlen; i++) {
+        int16_t v = job->target[i - job->origin];
+        energy += (int64_t)v * v;
+    }
+    return (double)energy;
+}
+
+typedef struct {
+    const ident_job* job;
+    size_t last_matched_end; // offsets up to here are not tested
+    start_list* out;
+    cpx* work; // transform buffer of this scan (fft path)
+} ident_scan;
+
+// exact test of one offset
+static bool offset_matches(const ident_job* job, size_t offset) {
+    return cross_correlation(job->target + (offset - job->origin), job->ad, job->alen) >= job->threshold;
+}
+
+// true once the scan found as many matches as its job asks for
+static bool scan_done(const ident_scan* scan) {
+    return scan->job->limit > 0 && scan->out->count >= scan->job->limit;
+}
+
+// test one offset, on a match record it and skip past it; false if out of memory
+static bool scan_offset(ident_scan* scan, size_t offset) {
+    if (!offset_matches(scan->job, offset)) return true;
+    if (!scan->job->overlap) scan->last_matched_end = offset + scan->job->alen - 1; //index
+    return start_list_add(scan->out, offset);
+}
+
+// test every offset of [from, to)
+static bool scan_direct(ident_scan* scan, size_t from, size_t to) {
+    /*
+        iterate target_data
+        [                 ]
+          [  ]-> [   ]
+    */
+    for (size_t offset = from; offset < to && !scan_done(scan); offset++) {
+        if (offset <= scan->last_matched_end) {
+            offset = scan->last_matched_end;
+            continue;
+        }
+        if (!scan_offset(scan, offset)) return false;
+    }
+    return true;
+}
+
+// scan the offsets [from, to) of one block using its estimates
+static bool scan_block(ident_scan* scan, bool imag, size_t from, size_t to, double bound2) {
+    for (size_t offset = from; offset < to && !scan_done(scan); offset++) {
+        if (offset <= scan->last_matched_end) {
+            offset = scan->last_matched_end;
+            continue;
+        }
+        double est = imag ? scan->work[offset - from].im : scan->work[offset - from].re;
+        double gap = scan->job->threshold - est;
+        //too far below the threshold to be a match
+        if (gap > 0 && gap * gap > bound2) continue;
+        if (!scan_offset(scan, offset)) return false;
+    }
+    return true;
+}
+
+// load the blocks at first and (if has_second) second into work and transform them
+static void fft_load_pair(const ident_job* job, size_t first, size_t second, bool has_second,
+                          size_t n, const cpx* twiddle, cpx* work) {
+    //two blocks in one transform: first in re, second in im
+    for (size_t i = 0; i < n; i++) {
+        size_t a = first + i, b = second + i;
+        work[i].re = a < job->tlen ? (double)job->target[a - job->origin] : 0.0;
+        work[i].im = has_second && b < job->tlen ? (double)job->target[b - job->origin] : 0.0;
+    }
+    fft(work, twiddle, n, false);
+}
+
+// correlate a transformed pair with the ad (out may be in)
+static void fft_correlate(const fft_plan* plan, const cpx* in, cpx* out) {
+    for (size_t i = 0; i < plan->n; i++) {
+        cpx x = in[i];
+        cpx h = plan->ad_spec[i];
+        out[i].re = x.re * h.re - x.im * h.im;
+        out[i].im = x.re * h.im + x.im * h.re;
+    }
+    fft(out, plan->twiddle, plan->n, true);
+}
+
+// test the offsets [from, to) that the fft estimates cannot rule out
+static bool scan_fft(ident_scan* scan, size_t from, size_t to) {
+    const ident_job* job = scan->job;
+    const fft_plan* plan = job->plan;
+    size_t n = plan->n;
+    double slack2 = plan->slack * plan->slack;
+
+    for (size_t first = from; first < to && !scan_done(scan); first += 2 * plan->step) {
+        size_t second = first + plan->step;
+        bool has_second = second < to;
+        fft_load_pair(job, first, second, has_second, n, plan->twiddle, scan->work);
+        fft_correlate(plan, scan->work, scan->work);
+
+        double energy = block_energy(job, first, n);
+        if (has_second) energy += block_energy(job, second, n);
+        double bound2 = slack2 * energy * plan->ad_energy;
+
+        size_t end = first + plan->step < to ? first + plan->step : to;
+        if (!scan_block(scan, false, first, end, bound2)) return false;
+        if (has_second) {
+            end = second + plan->step < to ? second + plan->step : to;
+            if (!scan_block(scan, true, second, end, bound2)) return false;
+        }
+    }
+    return true;
+}
+
+// scan [from, to) with the job's method, false if out of memory
+static bool scan_range(ident_scan* scan, size_t from, size_t to) {
+    if (scan_done(scan)) return true;
+    if (scan->job->plan) return scan_fft(scan, from, to);
+    return scan_direct(scan, from, to);
+}
+
+/*
+    stream scanner
+    scans a target that arrives as a sequence of sample runs and keeps only
+    the history incomplete windows still need: alen - 1 samples plus one
+    round of new offsets. a run long enough to hold whole windows is scanned
+    in place, so only the windows that straddle two runs are stitched in the
+    history. short ads are scanned as soon as a window completes, long ads
+    in rounds of fft estimates (2 blocks); stream_flush scans the rest.
+    the matches are the ones a scan over the whole target finds, however the
+    target is cut into runs.
+*/
+
+typedef struct {
+    ident_job job; // the ad, the target fields are set for each scan
+    cpx* work;
+    int16_t* history; // target samples [base, base + fill)
+    size_t cap;
+    size_t base;
+    size_t fill;
+    size_t fed; // offset of the next sample fed
+    size_t round; // offsets per scan round
+    size_t next; // first offset not scanned yet
+    size_t last_matched_end;
+    start_list* out;
+} ident_stream;
+
+static void stream_free(ident_stream* st) {
+    free(st->history);
+    free(st->work);
+}
+
+// restart at offset start, as if nothing before it had matched (0: a fresh scan)
+static void stream_reset(ident_stream* st, size_t start) {
+    st->base = start;
+    st->fill = 0;
+    st->fed = start;
+    st->next = start;
+    st->last_matched_end = start == 0 ? 0 : start - 1;
+}
+
+// set up a scan of the ad (fft estimates if plan), matches go to out; false if out of memory
+static bool stream_init(ident_stream* st, const int16_t* ad, size_t alen, double threshold,
+                        const fft_plan* plan, start_list* out) {
+    st->job.target = NULL;
+    st->job.origin = 0;
+    st->job.tlen = 0;
+    st->job.ad = ad;
+    st->job.alen = alen;
+    st->job.threshold = threshold;
+    st->job.plan = plan;
+    st->job.overlap = false;
+    st->job.limit = 0;
+    st->out = out;
+    st->round = plan ? 2 * plan->step : alen;
+    st->cap = alen - 1 + st->round;
+    st->history = malloc(st->cap * sizeof(int16_t));
+    st->work = plan ? malloc(plan->n * sizeof(cpx)) : NULL;
+    if (!st->history || (plan && !st->work)) {
+        stream_free(st);
+        return false;
+    }
+    stream_reset(st, 0);
+    return true;
+}
+
+// scan the offsets [next, to) of the history
+static bool stream_scan(ident_stream* st, size_t to) {
+    ident_job job = st->job;
+    job.target = st->history;
+    job.origin = st->base;
+    job.tlen = st->base + st->fill;
+
+    ident_scan scan;
+    scan.job = &job;
+    scan.last_matched_end = st->last_matched_end;
+    scan.out = st->out;
+    scan.work = st->work;
+    bool ok = scan_range(&scan, st->next, to);
+    st->next = to;
+    st->last_matched_end = scan.last_matched_end;
+    return ok;
+}
+
+// copy the next samples into the history, scanning windows as they complete
+static bool stream_feed(ident_stream* st, const int16_t* samples, size_t len) {
+    size_t alen = st->job.alen;
+    st->fed += len;
+
+    while (len > 0) {
+        //offsets before next are scanned and the ones inside a match are skipped,
+        //so their samples are not needed anymore
+        size_t keep = st->next;
+        if (st->last_matched_end + 1 > keep) keep = st->last_matched_end + 1;
+        if (keep > st->base) {
+            size_t drop = keep - st->base;
+            if (drop >= st->fill) {
+                //a match reaches past the buffered samples, skip the input up to its end
+                size_t skip = drop - st->fill;
+                if (skip > len) skip = len;
+                samples += skip;
+                len -= skip;
+                st->base += st->fill + skip;
+                st->fill = 0;
+            } else {
+                memmove(st->history, st->history + drop, (st->fill - drop) * sizeof(int16_t));
+                st->base += drop;
+                st->fill -= drop;
+            }
+            if (st->next < st->base) st->next = st->base;
+        }
+
+        size_t n = st->cap - st->fill;
+        if (n > len) n = len;
+        memcpy(st->history + st->fill, samples, n * sizeof(int16_t));
+        st->fill += n;
+        samples += n;
+        len -= n;
+
+        //scan once a round of windows is complete (every window for short ads)
+        if (st->fill < alen) continue;
+        size_t to = st->base + st->fill - alen + 1;
+        if (to <= st->next) continue;
+        if (st->job.plan && to - st->next < st->round) continue;
+        if (!stream_scan(st, to)) return false;
+    }
+    return true;
+}
+
+// scan every complete window still held back
+static bool stream_flush(ident_stream* st) {
+    if (st->fill < st->job.alen) return true;
+    size_t to = st->base + st->fill - st->job.alen + 1;
+    if (to <= st->next) return true;
+    return stream_scan(st, to);
+}
+
+// feed len zeros
+static bool stream_feed_silence(ident_stream* st, size_t len) {
+    while (len > 0) {
+        size_t n = len < SILENCE_SPAN ? len : SILENCE_SPAN;
+        if (!stream_feed(st, silence_samples, n)) return false;
+        len -= n;
+    }
+    return true;
+}
+
+// feed a run of samples that stays valid during the call, scanning its inner windows in place;
+// samples NULL is a run of silence, whose inner windows cannot match an ad that is not silent
+static bool stream_feed_run(ident_stream* st, const int16_t* samples, size_t len) {
+    size_t alen = st->job.alen;
+    size_t k = alen - 1;
+    //too short to be worth scanning in place
+    if (len < 2 * alen || (!samples && st->job.threshold <= 0.0)) {
+        return samples ? stream_feed(st, samples, len) : stream_feed_silence(st, len);
+    }
+
+    //windows that straddle the start of the run
+    size_t start = st->fed;
+    if (!(samples ? stream_feed(st, samples, k) : stream_feed_silence(st, k)) || !stream_flush(st)) return false;
+
+    //windows inside the run
+    ident_job job = st->job;
+    job.target = samples;
+    job.origin = start;
+    job.tlen = start + len;
+    ident_scan scan;
+    scan.job = &job;
+    scan.last_matched_end = st->last_matched_end;
+    scan.out = st->out;
+    scan.work = st->work;
+    size_t from = st->next > start ? st->next : start;
+    size_t to = start + len - k;
+    if (samples && from < to && !scan_range(&scan, from, to)) return false;
+    st->last_matched_end = scan.last_matched_end;
+    if (st->next < to) st->next = to;
+
+    //the tail of the run is the history of the next one
+    if (samples) {
+        memcpy(st->history, samples + len - k, k * sizeof(int16_t));
+    } else {
+        memset(st->history, 0, k * sizeof(int16_t));
+    }
+    st->base = start + len - k;
+    st->fill = k;
+    st->fed = start + len;
+    return true;
+}
+
+// scan target offsets [from, to) run by run, as if nothing before from had matched
+static bool stream_track(ident_stream* st, const sound_seg* target, size_t from, size_t to) {
+    span_iter it;
+    const int16_t* samples;
+    size_t n;
+    stream_reset(st, from);
+    span_begin(&it, target, from, to - from + st->job.alen - 1);
+    it.sparse = true;
+    while (span_next(&it, &samples, &n)) {
+        if (!stream_feed_run(st, samples, n)) return false;
+        if (st->job.limit > 0 && st->out->count >= st->job.limit) return true;
+    }
+    return stream_flush(st);
+}
+
+/*
+    parallel scan
+    the offsets are cut into chunks that workers scan on their own, each as if
+    nothing before the chunk had matched (a chunk reads alen - 1 samples past
+    its end, so neighbouring chunks overlap in the target).
+    merging goes chunk by chunk: when the previous chunk's last match reaches
+    into this chunk, the offsets the serial scan would test there but the
+    chunk scan skipped (inside its own matches) are tested again, until the
+    serial scan lands on a start the chunk also found; from there both agree.
+    with overlap nothing is skipped, and the chunks' starts are just joined.
+*/
+
+// worker threads of tr_identify, 0 means one per online cpu
+static size_t ident_threads = 1;
+
+void tr_set_threads(size_t threads) {
+    ident_threads = threads;
+}
+
+// fewest offsets a worker takes at a time
+#define IDENT_MIN_CHUNK ((size_t)1 << 15)
+
+typedef struct {
+    const ident_job* job; // the ad
+    const sound_seg* target;
+    size_t first; // offsets [first, first + offsets) are scanned
+    size_t offsets;
+    size_t chunk; // offsets per chunk
+    size_t chunks;
+    start_list* found; // starts found in each chunk
+    bool failed; // a worker ran out of memory
+    size_t next; // next chunk to hand out
+    pthread_mutex_t lock;
+} ident_pool;
+
+static void* ident_worker(void* arg) {
+    ident_pool* pool = (ident_pool*)arg;
+    const ident_job* job = pool->job;
+    ident_stream st;
+    bool started = stream_init(&st, job->ad, job->alen, job->threshold, job->plan, NULL);
+    bool ok = started;
+    st.job.overlap = job->overlap;
+
+    while (ok) {
+        pthread_mutex_lock(&pool->lock);
+        size_t c = pool->next++;
+        bool stop = pool->failed;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop || c >= pool->chunks) break;
+
+        size_t from = pool->first + c * pool->chunk;
+        size_t to = from + pool->chunk < pool->first + pool->offsets ? from + pool->chunk : pool->first + pool->offsets;
+        st.out = &pool->found[c];
+        ok = stream_track(&st, pool->target, from, to);
+    }
+    if (!ok) {
+        pthread_mutex_lock(&pool->lock);
+        pool->failed = true;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (started) stream_free(&st);
+    return NULL;
+}
+
+// exact test of the window of target at offset, read through window (alen samples)
+static bool window_matches(const ident_job* job, const sound_seg* target, size_t offset, int16_t* window) {
+    tr_read((sound_seg*)target, window, offset, job->alen);
+    return cross_correlation(window, job->ad, job->alen) >= job->threshold;
+}
+
+// append a chunk's starts to out as the serial scan would have found them
+static bool merge_chunk(const ident_pool* pool, size_t from, size_t to, const start_list* local,
+                        int16_t* window, size_t* last_matched_end, start_list* out) {
+    const ident_job* job = pool->job;
+    size_t alen = job->alen;
+    if (job->overlap) {
+        //no match skips anything, the chunk's own offsets are all it tested
+        for (size_t j = 0; j < local->count; j++) {
+            if (local->starts[j] >= from && local->starts[j] < to && !start_list_add(out, local->starts[j])) return false;
+        }
+        return true;
+    }
+    size_t offset = *last_matched_end + 1 > from ? *last_matched_end + 1 : from;
+    size_t j = 0;
+
+    while (offset < to) {
+        //chunk matches that end before offset are already covered
+        while (j < local->count && local->starts[j] + alen - 1 < offset) j++;
+        //every offset outside the chunk's matches was tested there and failed
+        if (j == local->count) break;
+        size_t start = local->starts[j];
+        if (offset < start) offset = start;
+
+        if (offset == start) {
+            //same state as the chunk scan from here on
+            for (; j < local->count; j++) {
+                if (!start_list_add(out, local->starts[j])) return false;
+                *last_matched_end = local->starts[j] + alen - 1;
+            }
+            break;
+        }
+
+        //inside a chunk match, the chunk never tested this offset
+        if (window_matches(job, pool->target, offset, window)) {
+            if (!start_list_add(out, offset)) return false;
+            *last_matched_end = offset + alen - 1;
+            offset = *last_matched_end + 1;
+        } else {
+            offset++;
+        }
+    }
+    return true;
+}
+
+// scan offsets [from, to) on a worker pool, false if it could not be set up (nothing scanned)
+static bool identify_parallel(const ident_job* job, const sound_seg* target, size_t from, size_t to,
+                              size_t threads, start_list* out) {
+    ident_pool pool;
+    pool.job = job;
+    pool.target = target;
+    pool.first = from;
+    pool.offsets = to - from;
+
+    //a few chunks per thread keep the workers busy to the end
+    size_t chunk = pool.offsets / (threads * 4) + 1;
+    if (chunk < IDENT_MIN_CHUNK) chunk = IDENT_MIN_CHUNK;
+    if (chunk < 4 * job->alen) chunk = 4 * job->alen;
+    if (job->plan) {
+        //whole transform pairs per chunk
+        size_t pair = 2 * job->plan->step;
+        chunk = (chunk + pair - 1) / pair * pair;
+    }
+    pool.chunk = chunk;
+    pool.chunks = (pool.offsets + chunk - 1) / chunk;
+    if (pool.chunks < 2) return false;
+    if (threads > pool.chunks) threads = pool.chunks;
+
+    pool.found = (start_list*)calloc(pool.chunks, sizeof(start_list));
+    pthread_t* workers = (pthread_t*)malloc((threads - 1) * sizeof(pthread_t));
+    int16_t* window = malloc(job->alen * sizeof(int16_t));
+    if (!pool.found || !workers || !window) {
+        free(pool.found);
+        free(workers);
+        free(window);
+        return false;
+    }
+    pool.failed = false;
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    //the calling thread is a worker too
+    size_t started = 0;
+    while (started < threads - 1) {
+        if (pthread_create(&workers[started], NULL, ident_worker, &pool) != 0) break;
+        started++;
+    }
+    ident_worker(&pool);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+
+    bool ok = !pool.failed;
+    size_t last_matched_end = from == 0 ? 0 : from - 1;
+    for (size_t c = 0; ok && c < pool.chunks; c++) {
+        size_t chunk_from = from + c * chunk;
+        size_t chunk_to = chunk_from + chunk < to ? chunk_from + chunk : to;
+        ok = merge_chunk(&pool, chunk_from, chunk_to, &pool.found[c], window, &last_matched_end, out);
+    }
+    for (size_t c = 0; c < pool.chunks; c++) {
+        free(pool.found[c].starts);
+    }
+    free(pool.found);
+    free(workers);
+    free(window);
+    if (ok) return true;
+
+    //a worker or the merge ran out of memory, let the serial scan start over
+    out->count = 0;
+    return false;
+}
+
+// scan offsets [from, to) on the calling thread, false if memory ran out (out may hold only the first starts)
+static bool identify_serial(const ident_job* job, const sound_seg* target, size_t from, size_t to, start_list* out) {
+    ident_stream st;
+    if (!stream_init(&st, job->ad, job->alen, job->threshold, job->plan, out)) {
+        //no room for the transform, test every offset
+        if (!job->plan || !stream_init(&st, job->ad, job->alen, job->threshold, NULL, out)) return false;
+    }
+    st.job.overlap = job->overlap;
+    st.job.limit = job->limit;
+    bool ok = stream_track(&st, target, from, to);
+    stream_free(&st);
+    return ok;
+}
+
+/*
+    coarse-to-fine scan
+    an opt-in prefilter of tr_identify_ex. target and ad are cut into blocks
+    of d samples and each block is replaced by its sum, a low-pass
+    fingerprint d times shorter. correlating the fingerprints at every d-th
+    offset costs about 1/d^2 of the exhaustive scan. a coarse offset whose
+    correlation reaches COARSE_RATIO x the threshold's share of the ad
+    fingerprint's auto correlation makes the 2d - 1 offsets around it
+    candidates, and only those are tested exactly, with the usual threshold
+    and skipping. a match whose fingerprint falls short is missed. with
+    overlap every match reported is one the exhaustive scan reports; without
+    it the skipping follows the matches found, so a missed match, or one
+    whose offset is no candidate, can leave a neighbouring offset reported
+    instead. ads that keep
+    less than COARSE_MIN_ENERGY of their energy in the fingerprint, or are
+    shorter than COARSE_MIN_BLOCKS blocks, are scanned exhaustively instead.
+*/
+
+// share of the scaled fingerprint correlation a coarse offset needs
+#define COARSE_RATIO 0.35
+// least share of the ad's energy its fingerprint must keep
+#define COARSE_MIN_ENERGY 0.4
+// fewest ad blocks in a fingerprint
+#define COARSE_MIN_BLOCKS 8
+// most offsets verified from one read of the target
+#define COARSE_MAX_RANGE ((size_t)1 << 16)
+
+// block sums of track[pos, pos + n * d) into fp[0, n)
+static void coarse_fingerprint(const sound_seg* track, size_t pos, size_t n, size_t d, double* fp) {
+    span_iter it;
+    const int16_t* samples;
+    size_t len;
+    size_t block = 0, fill = 0;
+    int64_t sum = 0;
+    span_begin(&it, track, pos, n * d);
+    it.sparse = true;
+    while (span_next(&it, &samples, &len)) {
+        for (size_t i = 0; i < len; i++) {
+            if (samples) sum += samples[i];
+            if (++fill == d) {
+                fp[block++] = (double)sum;
+                sum = 0;
+                fill = 0;
+            }
+        }
+    }
+}
+
+// test the offsets [lo, hi) exactly, reading the target once
+static bool coarse_verify(ident_scan* scan, const sound_seg* target, size_t lo, size_t hi,
+                          int16_t** window, size_t* window_cap) {
+    size_t n = hi - lo + scan->job->alen - 1;
+    if (n > *window_cap) {
+        int16_t* grown = (int16_t*)realloc(*window, n * sizeof(int16_t));
+        if (!grown) return false;
+        *window = grown;
+        *window_cap = n;
+    }
+    tr_read((struct sound_seg*)target, *window, lo, n);
+    ident_job job = *scan->job;
+    job.target = *window;
+    job.origin = lo;
+    job.tlen = lo + n;
+    job.plan = NULL;
+    ident_scan fine = *scan;
+    fine.job = &job;
+    bool ok = scan_direct(&fine, lo, hi);
+    scan->last_matched_end = fine.last_matched_end;
+    return ok;
+}
+
+// scan offsets [from, to) through fingerprints decimated by d, false if the
+// prefilter does not suit the ad or memory ran out (nothing is found then)
+static bool identify_coarse(const ident_job* job, const sound_seg* target, size_t from, size_t to,
+                            size_t d, start_list* out) {
+    size_t alen = job->alen;
+    size_t m = alen / d; // whole ad blocks
+    if (d < 2 || m < COARSE_MIN_BLOCKS || job->threshold <= 0.0) return false;
+    size_t blocks = (to - from + alen - 1) / d;
+
+    //the spectrum of the ad's fingerprint, and how much of the ad's energy it keeps
+    fft_plan plan;
+    if (!fft_plan_alloc(&plan, m, fft_log2_size(m, blocks), NULL)) return false;
+    double fp_energy = 0.0;
+    for (size_t i = 0; i < plan.n; i++) {
+        int64_t sum = 0;
+        for (size_t k = 0; i < m && k < d; k++) sum += job->ad[i * d + k];
+        plan.ad_spec[i].re = (double)sum;
+        plan.ad_spec[i].im = 0.0;
+        fp_energy += (double)sum * (double)sum;
+    }
+    double energy = auto_correlation(job->ad, alen);
+    if (fp_energy / (double)d < COARSE_MIN_ENERGY * energy) {
+        fft_plan_free(&plan);
+        return false;
+    }
+    fft_plan_transform(&plan);
+    double bar = COARSE_RATIO * (job->threshold / energy) * fp_energy;
+
+    //the target's fingerprint over the windows of [from, to)
+    double* tfp = malloc(blocks * sizeof(double));
+    cpx* work = malloc(plan.n * sizeof(cpx));
+    if (!tfp || !work) {
+        free(tfp);
+        free(work);
+        fft_plan_free(&plan);
+        return false;
+    }
+    coarse_fingerprint(target, from, blocks, d, tfp);
+
+    //coarse offset q stands for the fine offsets within d - 1 of from + q * d
+    ident_scan scan;
+    scan.job = job;
+    scan.last_matched_end = from == 0 ? 0 : from - 1;
+    scan.out = out;
+    scan.work = NULL;
+    int16_t* window = NULL;
+    size_t window_cap = 0;
+    size_t lo = from, hi = from; // candidates [lo, hi) not verified yet, the ones before hi are
+    size_t coarse_offsets = blocks - m + 1;
+    bool ok = true;
+    for (size_t first = 0; ok && first < coarse_offsets && !scan_done(&scan); first += 2 * plan.step) {
+        //two blocks of coarse offsets per transform, first in re, second in im
+        for (size_t i = 0; i < plan.n; i++) {
+            size_t a = first + i, b = first + plan.step + i;
+            work[i].re = a < blocks ? tfp[a] : 0.0;
+            work[i].im = b < blocks ? tfp[b] : 0.0;
+        }
+        fft(work, plan.twiddle, plan.n, false);
+        fft_correlate(&plan, work, work);
+
+        for (size_t k = 0; ok && k < 2 * plan.step && !scan_done(&scan); k++) {
+            size_t q = first + k;
+            if (q >= coarse_offsets) break;
+            double c = k < plan.step ? work[k].re : work[k - plan.step].im;
+            if (c < bar) continue;
+            size_t center = from + q * d;
+            size_t lead = center >= from + d - 1 ? center - (d - 1) : from;
+            size_t last = center + d < to ? center + d : to;
+            if (lo < hi && (lead > hi || hi - lo >= COARSE_MAX_RANGE)) {
+                ok = coarse_verify(&scan, target, lo, hi, &window, &window_cap);
+                lo = hi;
+            }
+            if (lo == hi) lo = lead > hi ? lead : hi;
+            if (last > hi) hi = last;
+        }
+    }
+    if (ok && lo < hi && !scan_done(&scan)) ok = coarse_verify(&scan, target, lo, hi, &window, &window_cap);
+    free(window);
+    free(work);
+    free(tfp);
+    fft_plan_free(&plan);
+    if (!ok) out->count = 0;
+    return ok;
+}
+
+// append a scored match to a list, false if out of memory
+static bool hit_list_add(struct ad_hit_list* list, size_t start, size_t end, double score) {
+    if (list->count == list->capacity) {
+        size_t new_cap = list->capacity ? list->capacity * 2 : 16;
+        struct ad_hit* new_hits = (struct ad_hit*)realloc(list->hits, new_cap * sizeof(struct ad_hit));
+        if (!new_hits) return false;
+        list->hits = new_hits;
+        list->capacity = new_cap;
+    }
+    list->hits[list->count].start = start;
+    list->hits[list->count].end = end;
+    list->hits[list->count].score = score;
+    list->count++;
+    return true;
+}
+
+void ad_identify_options_init(struct ad_identify_options* opts) {
+    if (!opts) return;
+    opts->threshold = 0.95;
+    opts->overlap = false;
+    opts->window_start = 0;
+    opts->window_len = 0;
+    opts->max_matches = 0;
+    opts->decimation = 0;
+}
+
+void ad_hit_list_free(struct ad_hit_list* list) {
+    if (!list) return;
+    free(list->hits);
+    list->hits = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+// the match starts of ad in target in increasing order (opts NULL: the defaults),
+// *alen gets the ad length and hits, if not NULL, the scored matches;
+// false if memory ran out (found may hold only the first starts)
+static bool identify_starts(const sound_seg* target, const sound_seg* ad, const struct ad_identify_options* opts,
+                            size_t* alen_out, start_list* found, struct ad_hit_list* hits) {
+    struct ad_identify_options defaults;
+    if (!opts) {
+        ad_identify_options_init(&defaults);
+        opts = &defaults;
+    }
+    *alen_out = 0;
+    if (!target || !ad) return true;
+
+    //use tr_length to get the length of the target
+    size_t tlen = tr_length((struct sound_seg*)target);
+    size_t alen = tr_length((struct sound_seg*)ad);
+    *alen_out = alen;
+
+    //only the window of the target is searched
+    size_t wstart = opts->window_start < tlen ? opts->window_start : tlen;
+    size_t wlen = tlen - wstart;
+    if (opts->window_len > 0 && opts->window_len < wlen) wlen = opts->window_len;
+
+    //if the length of ad is greater than the window or empty, there is no match
+    if (wlen == 0 || alen == 0 || alen > wlen) return true;
+
+    //the target is read in place, only the ad is copied
+    int16_t* ad_data = malloc(alen * sizeof(int16_t));
+    if (!ad_data) return false;
+    tr_read((struct sound_seg*)ad, ad_data, 0, alen);
+    
+    //calculate the auto correlation
+    double reference = auto_correlation(ad_data, alen);
+    double threshold = reference * opts->threshold;
+
+    ident_job job;
+    job.target = NULL;
+    job.origin = 0;
+    job.tlen = tlen;
+    job.ad = ad_data;
+    job.alen = alen;
+    job.threshold = threshold;
+    job.plan = NULL;
+    job.overlap = opts->overlap;
+    job.limit = opts->max_matches;
+
+    size_t from = wstart, to = wstart + wlen - alen + 1;
+    bool coarse = opts->decimation > 1 && identify_coarse(&job, target, from, to, opts->decimation, found);
+
+    //long ads go through the fft estimates when there are enough offsets to amortize them
+    fft_plan plan;
+    if (!coarse && alen >= FFT_MIN_AD_LEN && wlen - alen + 1 >= alen &&
+        fft_plan_init(&plan, ad_data, alen, fft_log2_size(alen, wlen), NULL)) {
+        job.plan = &plan;
+    }
+
+    //a scan that may stop early is left serial, chunks past the stop would be wasted
+    size_t threads = job.limit > 0 ? 1 : ident_threads;
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (size_t)online : 1;
+    }
+    bool ok = true;
+    if (!coarse && (threads < 2 || !identify_parallel(&job, target, from, to, threads, found))) {
+        ok = identify_serial(&job, target, from, to, found);
+    }
+    if (job.plan) fft_plan_free(&plan);
+
+    //score each match against the ad, the window is read back once per match
+    int16_t* window = NULL;
+    size_t reported = hits ? hits->count : 0;
+    if (ok && hits && found->count > 0) {
+        window = malloc(alen * sizeof(int16_t));
+        ok = window != NULL;
+    }
+    for (size_t i = 0; ok && window && i < found->count; i++) {
+        tr_read((struct sound_seg*)target, window, found->starts[i], alen);
+        double cc = cross_correlation(window, ad_data, alen);
+        ok = hit_list_add(hits, found->starts[i], found->starts[i] + alen - 1, reference > 0 ? cc / reference : 1.0);
+    }
+    if (!ok && hits) hits->count = reported;
+    free(window);
+    free(ad_data);
+    return ok;
+}
+
+// Identify the occurrences of ad in target as scored matches
+bool tr_identify_ex(const struct sound_seg* target, const struct sound_seg* ad,
+                    const struct ad_identify_options* opts, struct ad_hit_list* out) {
+    if (!out) return false;
+    start_list found = { NULL, 0, 0 };
+    size_t alen = 0;
+    bool ok = identify_starts(target, ad, opts, &alen, &found, out);
+    free(found.starts);
+    return ok;
+}
+
+// Returns a string containing <start>,<end> ad pairs in target
+char* tr_identify(const struct sound_seg* target, const struct sound_seg* ad) {
+    start_list found = { NULL, 0, 0 };
+    size_t alen = 0;
+    if (!identify_starts(target, ad, NULL, &alen, &found, NULL) && found.count == 0) {
+        free(found.starts);
+        char* empty = (char*)malloc(1);
+        if (empty) empty[0] = '\0';
+        return empty;
+    }
+
+    // initialize the first result
+    match_text result;
+    result.size = 256;
+    result.len = 0;
+    result.count = 0;
+    result.text = (char*)malloc(result.size);
+
+    //allocate failed
+    if (!result.text) {
+        free(found.starts);
+        return NULL;
+    }
+    result.text[0] = '\0';
+    for (size_t i = 0; i < found.count; i++) {
+        if (!match_text_add(&result, found.starts[i], found.starts[i] + alen - 1)) break;
+    }
+    free(found.starts);
+    return result.text;
+}
+
+// append a match to a list, false if out of memory
+static bool match_list_add(struct ad_match_list* list, size_t start, size_t end) {
+    if (list->count == list->capacity) {
+        size_t new_cap = list->capacity ? list->capacity * 2 : 16;
+        struct ad_match* new_matches = (struct ad_match*)realloc(list->matches, new_cap * sizeof(struct ad_match));
+        if (!new_matches) return false;
+        list->matches = new_matches;
+        list->capacity = new_cap;
+    }
+    list->matches[list->count].start = start;
+    list->matches[list->count].end = end;
+    list->count++;
+    return true;
+}
+
+void ad_match_list_free(struct ad_match_list* list) {
+    if (!list) return;
+    free(list->matches);
+    list->matches = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+/*
+    batch identification
+    one pass over the target serves every ad: the target is read once, each
+    pair of fft blocks is transformed and its energy summed once, and every
+    long ad correlates against that shared spectrum with one inverse
+    transform. short ads are scanned directly over the same tile while it is
+    still in cache. each ad keeps its own skip state, so its matches are the
+    ones tr_identify reports for it alone.
+    the target is not flattened: a window holds one tile of offsets plus the
+    longest ad less one sample, read from the node spans tile by tile, and the
+    overlap with the next tile moves to its front. the extra memory is
+    O(tile + longest ad) however long the target is.
+*/
+
+// offsets per tile when no ad uses the fft
+#define BATCH_TILE ((size_t)1 << 14)
+
+// Identify several ads in one traversal of the target
+bool tr_identify_many(const struct sound_seg* target, const struct sound_seg* const* ads,
+                      size_t nads, struct ad_match_list* results) {
+    if (!target || (nads > 0 && (!ads || !results))) return false;
+    size_t tlen = tr_length((struct sound_seg*)target);
+    if (nads == 0 || tlen == 0) return true;
+
+    ident_job* jobs = (ident_job*)calloc(nads, sizeof(ident_job));
+    ident_scan* scans = (ident_scan*)calloc(nads, sizeof(ident_scan));
+    fft_plan* plans = (fft_plan*)calloc(nads, sizeof(fft_plan));
+    start_list* found = (start_list*)calloc(nads, sizeof(start_list));
+    bool ok = jobs && scans && plans && found;
+
+    //flatten the ads, the longest one that uses the fft sets the shared block size
+    size_t fft_alen = 0;
+    size_t max_alen = 0;
+    size_t offsets = 0; // offsets of the ad with the most
+    for (size_t i = 0; ok && i < nads; i++) {
+        size_t alen = ads[i] ? tr_length((struct sound_seg*)ads[i]) : 0;
+        jobs[i].tlen = tlen;
+        if (alen == 0 || alen > tlen) continue;
+        int16_t* ad_data = malloc(alen * sizeof(int16_t));
+        if (!ad_data) {
+            ok = false;
+            break;
+        }
+        tr_read((struct sound_seg*)ads[i], ad_data, 0, alen);
+        jobs[i].ad = ad_data;
+        jobs[i].alen = alen;
+        jobs[i].threshold = auto_correlation(ad_data, alen) * 0.95;
+        if (alen > max_alen) max_alen = alen;
+        if (tlen - alen + 1 > offsets) offsets = tlen - alen + 1;
+        if (alen >= FFT_MIN_AD_LEN && tlen - alen + 1 >= alen && alen > fft_alen) fft_alen = alen;
+    }
+
+    //every long ad shares the twiddles, the spectrum of the target pair and its energy
+    unsigned log2n = 0;
+    size_t n = 0, step = BATCH_TILE / 2;
+    cpx* twiddle = NULL;
+    cpx* spectrum = NULL;
+    cpx* work = NULL;
+    if (ok && fft_alen > 0) {
+        log2n = fft_log2_size(fft_alen, tlen);
+        n = (size_t)1 << log2n;
+        step = n - fft_alen + 1;
+        twiddle = fft_twiddles(n);
+        spectrum = malloc(n * sizeof(cpx));
+        work = malloc(n * sizeof(cpx));
+        ok = twiddle && spectrum && work;
+        for (size_t i = 0; ok && i < nads; i++) {
+            size_t alen = jobs[i].alen;
+            if (alen < FFT_MIN_AD_LEN || tlen - alen + 1 < alen) continue;
+            ok = fft_plan_init(&plans[i], jobs[i].ad, alen, log2n, twiddle);
+            if (ok) jobs[i].plan = &plans[i];
+        }
+    }
+    for (size_t i = 0; ok && i < nads; i++) {
+        scans[i].job = &jobs[i];
+        scans[i].last_matched_end = 0;
+        scans[i].out = &found[i];
+        scans[i].work = work;
+    }
+
+    //the window holds the target samples of one tile (a block pair reads step + n <= this)
+    size_t tile = 2 * step;
+    size_t window_len = tile + max_alen - 1;
+    int16_t* window = ok && offsets > 0 ? malloc(window_len * sizeof(int16_t)) : NULL;
+    if (offsets > 0 && !window) ok = false;
+    size_t filled = 0; // target samples [first, first + filled) are in the window
+
+    //one tile is one pair of blocks
+    for (size_t first = 0; ok && first < offsets; first += tile) {
+        size_t second = first + step;
+
+        //keep the overlap with the previous tile, read the rest from the spans
+        if (first > 0) {
+            size_t keep = filled > tile ? filled - tile : 0;
+            memmove(window, window + tile, keep * sizeof(int16_t));
+            filled = keep;
+        }
+        size_t want = first + window_len < tlen ? window_len : tlen - first;
+        if (want > filled) {
+            tr_read((struct sound_seg*)target, window + filled, first + filled, want - filled);
+            filled = want;
+        }
+        for (size_t i = 0; i < nads; i++) {
+            jobs[i].target = window;
+            jobs[i].origin = first;
+        }
+        double bound_energy = 0.0;
+        if (n > 0) {
+            fft_load_pair(&jobs[0], first, second, second < offsets, n, twiddle, spectrum);
+            bound_energy = block_energy(&jobs[0], first, n);
+            if (second < offsets) bound_energy += block_energy(&jobs[0], second, n);
+        }
+
+        for (size_t i = 0; ok && i < nads; i++) {
+            const ident_job* job = &jobs[i];
+            if (job->alen == 0) continue;
+            size_t to = tlen - job->alen + 1;
+            if (first >= to) continue;
+
+            if (!job->plan) {
+                size_t end = first + 2 * step < to ? first + 2 * step : to;
+                ok = scan_direct(&scans[i], first, end);
+                continue;
+            }
+            const fft_plan* plan = job->plan;
+            fft_correlate(plan, spectrum, work);
+            double bound2 = plan->slack * plan->slack * bound_energy * plan->ad_energy;
+            size_t end = first + step < to ? first + step : to;
+            ok = scan_block(&scans[i], false, first, end, bound2);
+            if (ok && second < to) {
+                end = second + step < to ? second + step : to;
+                ok = scan_block(&scans[i], true, second, end, bound2);
+            }
+        }
+    }
+
+    for (size_t i = 0; jobs && found && i < nads; i++) {
+        for (size_t k = 0; ok && k < found[i].count; k++) {
+            ok = match_list_add(&results[i], found[i].starts[k], found[i].starts[k] + jobs[i].alen - 1);
+        }
+        if (jobs[i].plan) fft_plan_free(&plans[i]);
+        free((int16_t*)jobs[i].ad);
+        free(found[i].starts);
+    }
+    free(twiddle);
+    free(spectrum);
+    free(work);
+    free(found);
+    free(plans);
+    free(scans);
+    free(jobs);
+    free(window);
+    return ok;
+}
+
+/*
+    streaming detector
+    a stream scanner over a live feed, with its own copy of the ad: its
+    matches are the ones tr_identify reports on everything fed so far.
+*/
+
+struct ad_detector {
+    int16_t* ad;
+    fft_plan plan;
+    bool use_fft;
+    start_list found;
+    ident_stream stream;
+};
+
+// Create a detector for the ad track
+struct ad_detector* ad_detector_init(const struct sound_seg* ad) {
+    size_t alen = tr_length((struct sound_seg*)ad);
+    if (alen == 0) return NULL;
+
+    struct ad_detector* det = (struct ad_detector*)calloc(1, sizeof(struct ad_detector));
+    if (!det) return NULL;
+    det->ad = malloc(alen * sizeof(int16_t));
+    if (!det->ad) {
+        free(det);
+        return NULL;
+    }
+    tr_read((struct sound_seg*)ad, det->ad, 0, alen);
+    double threshold = auto_correlation(det->ad, alen) * 0.95;
+
+    //the smallest transform that fits the ad keeps the history short
+    if (alen >= FFT_MIN_AD_LEN && fft_plan_init(&det->plan, det->ad, alen, fft_log2_size(alen, 2 * alen), NULL)) {
+        det->use_fft = stream_init(&det->stream, det->ad, alen, threshold, &det->plan, &det->found);
+        if (!det->use_fft) fft_plan_free(&det->plan);
+    }
+    if (!det->use_fft && !stream_init(&det->stream, det->ad, alen, threshold, NULL, &det->found)) {
+        free(det->ad);
+        free(det);
+        return NULL;
+    }
+    return det;
+}
+
+void ad_detector_destroy(struct ad_detector* det) {
+    if (!det) return;
+    stream_free(&det->stream);
+    if (det->use_fft) fft_plan_free(&det->plan);
+    free(det->found.starts);
+    free(det->ad);
+    free(det);
+}
+
+// move the starts the stream found into out
+static bool detector_report(struct ad_detector* det, struct ad_match_list* out) {
+    bool ok = true;
+    for (size_t i = 0; ok && i < det->found.count; i++) {
+        size_t start = det->found.starts[i];
+        ok = match_list_add(out, start, start + det->stream.job.alen - 1);
+    }
+    det->found.count = 0;
+    return ok;
+}
+
+// Feed the next samples of the stream
+bool ad_detector_feed(struct ad_detector* det, const int16_t* samples, size_t len, struct ad_match_list* out) {
+    if (!det || !out || (!samples && len > 0)) return false;
+    bool ok = stream_feed(&det->stream, samples, len);
+    return detector_report(det, out) && ok;
+}
+
+// Scan the windows a long ad's detector is still holding back
+bool ad_detector_flush(struct ad_detector* det, struct ad_match_list* out) {
+    if (!det || !out) return false;
+    bool ok = stream_flush(&det->stream);
+    return detector_report(det, out) && ok;
+}
+
+// one shared node of dest per source node of src[srcpos, srcpos + len), linked by next; NULL if out of memory
+static seg_node* track_views(const sound_seg* src_track, sound_seg* dest_track, size_t srcpos, size_t len) {
+    seg_node* views = NULL;
+    seg_node* views_tail = NULL;
+    size_t segStart = 0;
+    seg_node* node = idx_find(src_track, srcpos, &segStart);
+    size_t offsetInNode = srcpos - segStart;
+    size_t viewed = 0;
+    while (viewed < len) {
+        size_t n = node->length - offsetInNode;
+        if (n > len - viewed) n = len - viewed;
+        if (n > 0 && !node->buf && !node->shared) {
+            //owned silence gets a buffer to share, so a later write to it reaches the view
+            node->buf = buf_new_silent(node->length);
+            if (!node->buf) {
+                node_free_list(dest_track, views);
+                return NULL;
+            }
+            node->offset = 0;
+        }
+        seg_node* view = n > 0 ? node_new(dest_track, buf_ref(node->buf), node->offset + offsetInNode, n) : NULL;
+        if (n > 0 && !view) {
+            buf_release(node->buf);
+            node_free_list(dest_track, views);
+            return NULL;
+        }
+        if (view) {
+            view->shared = true;
+            if (views_tail) {
+                views_tail->next = view;
+            } else {
+                views = view;
+            }
+            views_tail = view;
+        }
+        viewed += n;
+        offsetInNode = 0;
+        node = node->next;
+    }
+    return views;
+}
+
+// link views (len samples from track_views) into dest at destpos, they are freed if out of memory
+static bool track_splice(sound_seg* dest_track, size_t destpos, seg_node* views, size_t len) {
+    //find the node the shared nodes go after (NULL: insert at the front)
+    seg_node* prev = NULL;
+    if (destpos > 0) {
+        size_t segStart = 0;
+        prev = idx_find(dest_track, destpos - 1, &segStart);
+        size_t offsetInNode = destpos - segStart;
+
+        //judge if it is in middle, let the second part in the tail node
+        if (offsetInNode < prev->length && !node_split(dest_track, prev, offsetInNode)) {
+            node_free_list(dest_track, views);
+            return false;
+        }
+    }
+
+    //insert the shared nodes
+    while (views) {
+        seg_node* next = views->next;
+        idx_insert_after(dest_track, prev, views);
+        prev = views;
+        views = next;
+    }
+    dest_track->length += len;
+    return true;
+}
+
+// Insert a portion of src_track into dest_track at position destpos
+void tr_insert(struct sound_seg* src_track,
+            struct sound_seg* dest_track,
+            size_t destpos, size_t srcpos, size_t len) {
+    //check egde
+    if (!src_track || !dest_track || len == 0) return;
+    if (destpos > dest_track->length) destpos = dest_track->length;
+    if (srcpos >= src_track->length) return;
+    if (srcpos + len > src_track->length) len = src_track->length - srcpos;
+    if (len == 0) return;
+    dest_track->version++;
+
+    //the views are built before dest changes (src may be dest)
+    seg_node* views = track_views(src_track, dest_track, srcpos, len);
+    if (!views || !track_splice(dest_track, destpos, views, len)) return;
+    compact_auto(dest_track);
+    return;
+}
+
+/*
+    edit batches
+    edits are recorded in the coordinates of the track as it is at commit.
+    the commit sorts them by position, merges overlapping deletes, builds the
+    views of every insert before the track changes and then applies the
+    edits from the end of the track down, so no edit moves the position of
+    one still to come. the version bump and compaction happen once.
+*/
+
+enum { BATCH_INSERT, BATCH_WRITE, BATCH_DELETE };
+
+typedef struct {
+    int kind;
+    size_t pos;
+    size_t len;
+    size_t seq; // order added, inserts at one position keep it
+    int16_t* samples; // write: copy of the samples
+    const sound_seg* src; // insert: the source range
+    size_t srcpos;
+    seg_node* views; // insert: built by the commit
+} batch_op;
+
+struct tr_batch {
+    sound_seg* track;
+    batch_op* ops;
+    size_t count;
+    size_t cap;
+    bool failed; // an edit could not be recorded, the commit applies nothing
+};
+
+struct tr_batch* tr_batch_begin(struct sound_seg* track) {
+    if (!track) return NULL;
+    struct tr_batch* batch = (struct tr_batch*)calloc(1, sizeof(struct tr_batch));
+    if (batch) batch->track = track;
+    return batch;
+}
+
+// record one edit, NULL if out of memory
+static batch_op* batch_add(struct tr_batch* batch, int kind, size_t pos, size_t len) {
+    if (batch->count == batch->cap) {
+        size_t new_cap = batch->cap ? batch->cap * 2 : 16;
+        batch_op* new_ops = (batch_op*)realloc(batch->ops, new_cap * sizeof(batch_op));
+        if (!new_ops) {
+            batch->failed = true;
+            return NULL;
+        }
+        batch->ops = new_ops;
+        batch->cap = new_cap;
+    }
+    batch_op* op = &batch->ops[batch->count];
+    op->kind = kind;
+    op->pos = pos;
+    op->len = len;
+    op->seq = batch->count++;
+    op->samples = NULL;
+    op->src = NULL;
+    op->srcpos = 0;
+    op->views = NULL;
+    return op;
+}
+
+bool tr_batch_write(struct tr_batch* batch, const int16_t* src, size_t pos, size_t len) {
+    if (!batch || !src) return false;
+    if (len == 0) return true;
+    int16_t* samples = (int16_t*)malloc(len * sizeof(int16_t));
+    batch_op* op = samples ? batch_add(batch, BATCH_WRITE, pos, len) : NULL;
+    if (!op) {
+        free(samples);
+        batch->failed = true;
+        return false;
+    }
+    memcpy(samples, src, len * sizeof(int16_t));
+    op->samples = samples;
+    return true;
+}
+
+bool tr_batch_delete(struct tr_batch* batch, size_t pos, size_t len) {
+    if (!batch) return false;
+    return len == 0 || batch_add(batch, BATCH_DELETE, pos, len);
+}
+
+bool tr_batch_insert(struct tr_batch* batch, struct sound_seg* src_track, size_t destpos, size_t srcpos, size_t len) {
+    if (!batch || !src_track) return false;
+    if (len == 0) return true;
+    batch_op* op = batch_add(batch, BATCH_INSERT, destpos, len);
+    if (!op) return false;
+    op->src = src_track;
+    op->srcpos = srcpos;
+    return true;
+}
+
+// by position, inserts before the write or delete starting there, then in the order added
+static int batch_cmp(const void* a, const void* b) {
+    const batch_op* x = (const batch_op*)a;
+    const batch_op* y = (const batch_op*)b;
+    if (x->pos != y->pos) return x->pos < y->pos ? -1 : 1;
+    if ((x->kind == BATCH_INSERT) != (y->kind == BATCH_INSERT)) return x->kind == BATCH_INSERT ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+void tr_batch_abort(struct tr_batch* batch) {
+    if (!batch) return;
+    for (size_t i = 0; i < batch->count; i++) {
+        free(batch->ops[i].samples);
+        if (batch->ops[i].views) node_free_list(batch->track, batch->ops[i].views);
+    }
+    free(batch->ops);
+    free(batch);
+}
+
+// clip the edits to the track, sort them and merge overlapping deletes; false if they conflict
+static bool batch_prepare(struct tr_batch* batch) {
+    size_t length = batch->track->length;
+    size_t kept = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        batch_op op = batch->ops[i];
+        if (op.kind == BATCH_DELETE) {
+            if (op.pos >= length) op.len = 0;
+            else if (op.len > length - op.pos) op.len = length - op.pos;
+        } else {
+            if (op.pos > length) op.pos = length;
+            if (op.kind == BATCH_INSERT) {
+                if (op.srcpos >= op.src->length) op.len = 0;
+                else if (op.len > op.src->length - op.srcpos) op.len = op.src->length - op.srcpos;
+            }
+        }
+        if (op.len == 0) {
+            free(op.samples);
+            continue;
+        }
+        batch->ops[kept++] = op;
+    }
+    batch->count = kept;
+    if (kept > 1) qsort(batch->ops, kept, sizeof(batch_op), batch_cmp);
+
+    //writes and deletes may not overlap but deletes may, an insert may not fall inside either
+    size_t range_end = 0;
+    bool range_deletes = false;
+    for (size_t i = 0; i < batch->count; i++) {
+        const batch_op* op = &batch->ops[i];
+        if (op->pos < range_end) {
+            if (op->kind != BATCH_DELETE || !range_deletes) return false;
+            if (op->pos + op->len > range_end) range_end = op->pos + op->len;
+        } else if (op->kind != BATCH_INSERT) {
+            range_end = op->pos + op->len;
+            range_deletes = op->kind == BATCH_DELETE;
+        }
+    }
+
+    //the checks passed, so merging only ever drops deletes
+    batch_op* range = NULL;
+    kept = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        batch_op* op = &batch->ops[i];
+        if (op->kind != BATCH_INSERT && range && op->pos < range->pos + range->len) {
+            if (op->pos + op->len > range->pos + range->len) range->len = op->pos + op->len - range->pos;
+            continue;
+        }
+        batch->ops[kept] = *op;
+        if (op->kind != BATCH_INSERT) range = &batch->ops[kept];
+        kept++;
+    }
+    batch->count = kept;
+    return true;
+}
+
+bool tr_batch_commit(struct tr_batch* batch) {
+    if (!batch) return false;
+    sound_seg* track = batch->track;
+    bool ok = !batch->failed && batch_prepare(batch);
+
+    //every insert views its source before the track changes (the source may be the track)
+    for (size_t i = 0; ok && i < batch->count; i++) {
+        batch_op* op = &batch->ops[i];
+        if (op->kind != BATCH_INSERT) continue;
+        op->views = track_views(op->src, track, op->srcpos, op->len);
+        if (!op->views) ok = false;
+    }
+    if (ok && batch->count > 0) {
+        track->version++;
+        for (size_t i = batch->count; ok && i-- > 0;) {
+            batch_op* op = &batch->ops[i];
+            if (op->kind == BATCH_WRITE) {
+                track_write_runs(track, op->samples, op->pos, op->len);
+            } else if (op->kind == BATCH_DELETE) {
+                ok = track_delete(track, op->pos, op->len);
+            } else {
+                ok = track_splice(track, op->pos, op->views, op->len);
+                op->views = NULL;
+            }
+        }
+        compact_auto(track);
+    }
+    tr_batch_abort(batch);
+    return ok;
+}
+
+/*
+    ad stripping
+    tr_strip finds the matches like tr_identify and cuts them all out in one
+    walk of the node list. a node no match touches stays as it is, a node a
+    match cuts into views what is left of its buffer, and a node holding
+    several gaps between matches becomes one node per gap, so no sample is
+    copied. the index is rebuilt once at the end instead of per node.
+*/
+
+// the next kept range, it starts at *at (moved past the matches covering it)
+// and ends at the returned position, the start of match *k (SIZE_MAX: none)
+static size_t strip_gap(const start_list* found, size_t alen, size_t* k, size_t* at) {
+    while (*k < found->count && found->starts[*k] <= *at) {
+        if (found->starts[*k] + alen > *at) *at = found->starts[*k] + alen;
+        (*k)++;
+    }
+    return *k < found->count ? found->starts[*k] : SIZE_MAX;
+}
+
+// Remove every occurrence of ad from target in one pass
+bool tr_strip(struct sound_seg* target, const struct sound_seg* ad, struct ad_match_list* removed) {
+    if (!target || !ad) return false;
+    start_list found = { NULL, 0, 0 };
+    size_t alen = 0;
+    if (!identify_starts(target, ad, NULL, &alen, &found, NULL)) {
+        free(found.starts);
+        return false;
+    }
+
+    //report the matches first, nothing has changed if that fails
+    size_t reported = removed ? removed->count : 0;
+    for (size_t i = 0; removed && i < found.count; i++) {
+        if (!match_list_add(removed, found.starts[i], found.starts[i] + alen - 1)) {
+            removed->count = reported;
+            free(found.starts);
+            return false;
+        }
+    }
+    if (found.count == 0) {
+        free(found.starts);
+        return true;
+    }
+
+    //every gap after the first one in a node needs a node of its own, allocated up front
+    seg_node* spares = NULL;
+    size_t k = 0, at = 0, pos = 0;
+    for (seg_node* node = target->head; node; node = node->next) {
+        size_t end = pos + node->length;
+        if (at < pos) at = pos;
+        size_t gaps = 0;
+        while (at < end) {
+            size_t gap_end = strip_gap(&found, alen, &k, &at);
+            if (at >= end) break;
+            gaps++;
+            at = gap_end < end ? gap_end : end;
+        }
+        for (size_t i = 1; i < gaps; i++) {
+            seg_node* spare = node_new(target, NULL, 0, 0);
+            if (!spare) {
+                node_free_list(target, spares);
+                if (removed) removed->count = reported;
+                free(found.starts);
+                return false;
+            }
+            spare->next = spares;
+            spares = spare;
+        }
+        pos = end;
+    }
+
+    //relink the list from the gaps, nothing can fail from here on
+    seg_node* last = NULL;
+    size_t nodes = 0, length = 0;
+    k = 0;
+    at = 0;
+    pos = 0;
+    seg_node* node = target->head;
+    target->head = NULL;
+    while (node) {
+        seg_node* next = node->next;
+        size_t end = pos + node->length;
+        size_t offset = node->offset;
+        seg_node* piece = node;
+        if (at < pos) at = pos;
+        while (at < end) {
+            size_t gap_end = strip_gap(&found, alen, &k, &at);
+            if (at >= end) break;
+            size_t stop = gap_end < end ? gap_end : end;
+            if (!piece) {
+                piece = spares;
+                spares = spares->next;
+                piece->buf = buf_ref(node->buf);
+                piece->shared = node->shared;
+                piece->priority = idx_priority(target);
+            }
+            piece->offset = offset + (at - pos);
+            piece->length = stop - at;
+            piece->prev = last;
+            piece->next = NULL;
+            if (last) {
+                last->next = piece;
+            } else {
+                target->head = piece;
+            }
+            last = piece;
+            nodes++;
+            length += piece->length;
+            piece = NULL;
+            at = stop;
+        }
+        //a node inside the matches is dropped
+        if (piece) node_free(target, piece);
+        pos = end;
+        node = next;
+    }
+    target->tail = last;
+    target->nodes = nodes;
+    target->length = length;
+    idx_rebuild(target);
+    target->version++;
+    free(found.starts);
+    compact_auto(target);
+    return true;
+}
+
+/*
+    correlation kernels
+    a dot product of int16 samples is summed exactly in 64-bit integers, the
+    widest kernel the cpu supports is picked on the first call.
+    every partial sum of the old double loop was an integer below 2^53 for
+    len < 2^23, so for those lengths the result is bit-identical to it.
+*/
+
+typedef int64_t (*dot_fn)(const int16_t* a, const int16_t* b, size_t len);
+
+// portable kernel, also the tail of the vector kernels; compilers vectorize it (neon, sse)
+static int64_t dot_portable(const int16_t* a, const int16_t* b, size_t len) {
+    int64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        s0 += (int32_t)a[i] * b[i];
+        s1 += (int32_t)a[i + 1] * b[i + 1];
+        s2 += (int32_t)a[i + 2] * b[i + 2];
+        s3 += (int32_t)a[i + 3] * b[i + 3];
+    }
+    for (; i < len; i++) {
+        s0 += (int32_t)a[i] * b[i];
+    }
+    return s0 + s1 + s2 + s3;
+}
+
+#if defined(DOT_X86)
+/*
+    madd multiplies int16 lanes and adds neighbouring products into int32.
+    the only sum that does not fit is (-32768)^2 + (-32768)^2 = 2^31, which
+    wraps to INT32_MIN (no true sum is that negative), so each INT32_MIN lane
+    is counted and 2^32 added back per count. counts are flushed into the
+    64-bit total every DOT_FLUSH vectors so the int32 counters cannot wrap.
+*/
+#define DOT_FLUSH ((size_t)1 << 24)
+
+__attribute__((target("sse2")))
+static int64_t dot_sse2(const int16_t* a, const int16_t* b, size_t len) {
+    const __m128i wrapped = _mm_set1_epi32(INT32_MIN);
+    int64_t total = 0;
+    size_t i = 0;
+    while (i + 8 <= len) {
+        __m128i acc = _mm_setzero_si128();
+        __m128i count = _mm_setzero_si128();
+        size_t stop = len - (len - i) % 8;
+        if (stop - i > DOT_FLUSH * 8) stop = i + DOT_FLUSH * 8;
+        for (; i < stop; i += 8) {
+            __m128i p = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(a + i)),
+                                       _mm_loadu_si128((const __m128i*)(b + i)));
+            count = _mm_sub_epi32(count, _mm_cmpeq_epi32(p, wrapped));
+            __m128i sign = _mm_srai_epi32(p, 31);
+            acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(p, sign));
+            acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(p, sign));
+        }
+        int64_t lanes[2];
+        int32_t counts[4];
+        _mm_storeu_si128((__m128i*)lanes, acc);
+        _mm_storeu_si128((__m128i*)counts, count);
+        total += lanes[0] + lanes[1];
+        total += ((int64_t)counts[0] + counts[1] + counts[2] + counts[3]) << 32;
+    }
+    return total + dot_portable(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int64_t dot_avx2(const int16_t* a, const int16_t* b, size_t len) {
+    const __m256i wrapped = _mm256_set1_epi32(INT32_MIN);
+    int64_t total = 0;
+    size_t i = 0;
+    while (i + 16 <= len) {
+        __m256i acc = _mm256_setzero_si256();
+        __m256i count = _mm256_setzero_si256();
+        size_t stop = len - (len - i) % 16;
+        if (stop - i > DOT_FLUSH * 16) stop = i + DOT_FLUSH * 16;
+        for (; i < stop; i += 16) {
+            __m256i p = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                          _mm256_loadu_si256((const __m256i*)(b + i)));
+            count = _mm256_sub_epi32(count, _mm256_cmpeq_epi32(p, wrapped));
+            acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(p)));
+            acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(p, 1)));
+        }
+        int64_t lanes[4];
+        int32_t counts[8];
+        _mm256_storeu_si256((__m256i*)lanes, acc);
+        _mm256_storeu_si256((__m256i*)counts, count);
+        total += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        int64_t wraps = 0;
+        for (int k = 0; k < 8; k++) wraps += counts[k];
+        total += wraps << 32;
+    }
+    //leave no dirty upper lanes behind for the sse code of the caller
+    _mm256_zeroupper();
+    return total + dot_portable(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int64_t dot_avx512(const int16_t* a, const int16_t* b, size_t len) {
+    const __m512i wrapped = _mm512_set1_epi32(INT32_MIN);
+    __m512i acc = _mm512_setzero_si512();
+    int64_t wraps = 0;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m512i p = _mm512_madd_epi16(_mm512_loadu_si512((const void*)(a + i)),
+                                      _mm512_loadu_si512((const void*)(b + i)));
+        wraps += __builtin_popcount((unsigned)_mm512_cmpeq_epi32_mask(p, wrapped));
+        acc = _mm512_add_epi64(acc, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(p)));
+        acc = _mm512_add_epi64(acc, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(p, 1)));
+    }
+    int64_t total = _mm512_reduce_add_epi64(acc) + (wraps << 32);
+    _mm256_zeroupper();
+    return total + dot_portable(a + i, b + i, len - i);
+}
+#endif
+
+// pick the widest kernel the cpu runs
+static dot_fn dot_select(void) {
+#if defined(DOT_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) return dot_avx512;
+    if (__builtin_cpu_supports("avx2")) return dot_avx2;
+    if (__builtin_cpu_supports("sse2")) return dot_sse2;
+#endif
+    return dot_portable;
+}
+
+static dot_fn dot_kernel = NULL;
+static pthread_once_t dot_once = PTHREAD_ONCE_INIT;
+
+static void dot_init(void) {
+    dot_kernel = dot_select();
+}
+
+// the first calls may come from several threads at once
+static int64_t dot(const int16_t* a, const int16_t* b, size_t len) {
+    pthread_once(&dot_once, dot_init);
+    return dot_kernel(a, b, len);
+}
+
+double cross_correlation(const int16_t* a, const int16_t* b, size_t len) {
+    return (double)dot(a, b, len);
 }
 
 double auto_correlation(const int16_t* a, size_t len) {
     return cross_correlation(a, a, len);
-}
\ No newline at end of file
+}
@@ -14,6 +14,8 @@ struct sound_seg;
 /**
  * Calculates the cross-correlation between two audio sample arrays.
  * Used to measure similarity between audio segments.
+ * The products are summed exactly in 64-bit integers by the widest
+ * SIMD kernel the CPU supports.
  *
  * @param a First array of audio samples
  * @param b Second array of audio samples
@@ -34,7 +36,9 @@ double auto_correlation(const int16_t* a, size_t len);
 
 /**
  * Loads raw audio samples from a WAV file into a destination buffer.
- * The WAV file header is discarded during loading.
+ * For a file wav_open accepts only the data chunk is loaded, converted to
+ * 8000 Hz 16-bit mono, and never more samples than the bytes after a 44-byte
+ * header would hold; any other file is copied raw from byte 44 on.
  *
  * @param fname The path to the WAV file
  * @param dest The destination buffer to store audio samples
@@ -51,6 +55,107 @@ void wav_load(const char* fname, int16_t* dest);
  */
 void wav_save(const char* fname, const int16_t* src, size_t len);
 
+/**
+ * A WAV file opened for streaming reads.
+ * This is an opaque structure - details are defined in the implementation file.
+ */
+struct wav_reader;
+
+/**
+ * Opens a WAV file for streaming reads.
+ * The RIFF chunks are parsed up to the data chunk; reads then return the
+ * samples of the data chunk only, through a bounded I/O buffer.
+ * Files that are not 8000 Hz 16-bit mono PCM (integer PCM of 8 to 32 bits or
+ * 32/64-bit float, any rate and channel count) are converted as they are
+ * read: the channels are averaged, the rate is converted to 8000 Hz by a
+ * low-pass polyphase filter and the samples are rounded to 16 bits.
+ *
+ * @param fname The path to the WAV file
+ * @return The reader, or NULL if the file cannot be opened or its format is not supported
+ */
+struct wav_reader* wav_open(const char* fname);
+
+/**
+ * Reads the next samples of the data chunk into a buffer.
+ *
+ * @param r The reader
+ * @param dest The destination buffer, room for n samples
+ * @param n The most samples to read
+ * @return The number of samples read, less than n only at the end of the data
+ */
+size_t wav_read(struct wav_reader* r, int16_t* dest, size_t n);
+
+/**
+ * Reads the next samples of the data chunk onto the end of a track,
+ * without an intermediate buffer.
+ *
+ * @param r The reader
+ * @param track The track to append to
+ * @param n The most samples to read, SIZE_MAX for the rest of the data
+ * @return The number of samples appended
+ */
+size_t wav_read_track(struct wav_reader* r, struct sound_seg* track, size_t n);
+
+/**
+ * Closes a reader and frees its resources.
+ *
+ * @param r The reader
+ */
+void wav_close(struct wav_reader* r);
+
+/**
+ * Loads a WAV file as a track backed by the file itself.
+ * An 8000 Hz 16-bit mono PCM file is memory-mapped read-only, so opening is
+ * near-instant and the samples come from the page cache as they are read;
+ * an edited range is copied to memory first. The file is unmapped once no
+ * track uses it. Other formats are converted into memory as by wav_open.
+ *
+ * @param fname The path to the WAV file
+ * @return The new track, or NULL if the file cannot be opened or its format is not supported
+ */
+struct sound_seg* wav_map(const char* fname);
+
+/**
+ * Saves a track to a WAV file (8000 Hz 16-bit mono PCM) without copying it
+ * to a temporary buffer: the samples are written straight from the
+ * track's segments, many segments per system call. The file is written
+ * next to fname and renamed over it, so fname may be the file a track was
+ * opened from with wav_map.
+ *
+ * @param track The audio track to save
+ * @param fname The path to the WAV file to create
+ * @return true on success, false if the file could not be written
+ */
+bool tr_save(struct sound_seg* track, const char* fname);
+
+/**
+ * Saves a set of tracks to a project file that keeps their segments and the
+ * sharing between them: every range of samples is stored once however many
+ * segments, of however many of the tracks, view it. The file is written
+ * next to fname and renamed over it, so tracks loaded from an older version
+ * of the file stay valid.
+ *
+ * @param fname The path to the project file to create
+ * @param tracks The tracks to save
+ * @param count The number of tracks
+ * @return true on success, false if the file could not be written or memory ran out
+ */
+bool tr_save_project(const char* fname, struct sound_seg* const* tracks, size_t count);
+
+/**
+ * Loads the tracks of a project file written by tr_save_project.
+ * The file is memory-mapped copy-on-write, so loading costs time in the
+ * number of segments only and samples are read in as they are used; the
+ * loaded tracks share their samples as the saved ones did, and edits never
+ * change the file. The file is unmapped once no track uses it.
+ *
+ * @param fname The path to the project file
+ * @param count Set to the number of tracks loaded
+ * @return An array of the tracks in saved order, to be released with free()
+ *         after destroying them, or NULL if the file cannot be loaded
+ */
+struct sound_seg** tr_load_project(const char* fname, size_t* count);
+
 /**
  * Initializes a new empty audio track.
  *
@@ -73,6 +178,27 @@ void tr_destroy(struct sound_seg* track);
  */
 size_t tr_length(struct sound_seg* track);
 
+/**
+ * Allocator hooks for tracks, segment nodes and sample buffers.
+ * free receives the size that was passed to alloc for the same block.
+ */
+struct sound_allocator {
+    void* (*alloc)(size_t size, void* ctx);
+    void (*free)(void* ptr, size_t size, void* ctx);
+    void* ctx; // passed to both hooks
+};
+
+/**
+ * Replaces the allocator hooks the library gets its memory from.
+ * Nodes come from slabs owned by each track and released together by
+ * tr_destroy; small sample buffers are recycled through size classes.
+ * Call it while no track exists: memory must go back to the hooks that
+ * allocated it.
+ *
+ * @param hooks The new hooks, copied; NULL restores malloc and free
+ */
+void tr_set_allocator(const struct sound_allocator* hooks);
+
 /**
  * Reads audio samples from a track into a destination buffer.
  *
@@ -83,6 +209,58 @@ size_t tr_length(struct sound_seg* track);
  */
 void tr_read(struct sound_seg* track, int16_t* dest, size_t pos, size_t len);
 
+/**
+ * A read position in a track for sequential reads such as playback.
+ * This is an opaque structure - details are defined in the implementation file.
+ */
+struct tr_cursor;
+
+/**
+ * Opens a cursor on a track. The cursor remembers the segment its position
+ * lies in, so each read that continues where the previous one stopped costs
+ * only the samples it copies. The track may be edited between reads; the
+ * next read then finds the position again. Close the cursor before the
+ * track is destroyed.
+ *
+ * @param track The audio track to read
+ * @param pos The starting position
+ * @return The cursor, or NULL if the track is NULL or memory ran out
+ */
+struct tr_cursor* tr_cursor_open(struct sound_seg* track, size_t pos);
+
+/**
+ * Reads the samples at the cursor's position and moves it past them.
+ *
+ * @param cur The cursor
+ * @param dest The destination buffer, room for len samples
+ * @param len The most samples to read
+ * @return The number of samples read, less than len only at the end of the track
+ */
+size_t tr_cursor_read(struct tr_cursor* cur, int16_t* dest, size_t len);
+
+/**
+ * Moves a cursor to a new position.
+ *
+ * @param cur The cursor
+ * @param pos The new position; reads past the end of the track return nothing
+ */
+void tr_cursor_seek(struct tr_cursor* cur, size_t pos);
+
+/**
+ * Returns the position of a cursor.
+ *
+ * @param cur The cursor
+ * @return The position the next read starts at
+ */
+size_t tr_cursor_tell(const struct tr_cursor* cur);
+
+/**
+ * Closes a cursor and frees it.
+ *
+ * @param cur The cursor
+ */
+void tr_cursor_close(struct tr_cursor* cur);
+
 /**
  * Writes audio samples from a source buffer into a track.
  * If the write extends beyond the track's length, the track is extended.
@@ -94,17 +272,84 @@ void tr_read(struct sound_seg* track, int16_t* dest, size_t pos, size_t len);
  */
 void tr_write(struct sound_seg* track, const int16_t* src, size_t pos, size_t len);
 
+/**
+ * Writes silence into a track, like tr_write with a buffer of zeros, but the
+ * silent range is stored as a length only, without samples; reading it and
+ * scanning it with tr_identify costs next to nothing. Inserted copies of
+ * the track's own samples still see the zeros, and copies inserted from the
+ * silent range see later writes to it, as they would after tr_write: such a
+ * write fills the silence with samples in place.
+ *
+ * @param track The destination audio track
+ * @param pos The position in the track to start writing
+ * @param len The number of silent samples to write
+ * @return true on success, false if memory ran out
+ */
+bool tr_fill_silence(struct sound_seg* track, size_t pos, size_t len);
+
+/**
+ * Makes tr_write store runs of at least min_len zero samples as silence (see
+ * tr_fill_silence), and tr_compact convert such runs the track already holds
+ * where no other track views them. Only memory use changes: every read,
+ * and every copy inserted from the track, gives the same samples as without.
+ *
+ * @param track The audio track
+ * @param min_len The shortest run to convert, 0 (the default) turns it off
+ */
+void tr_set_silence_detect(struct sound_seg* track, size_t min_len);
+
 /**
  * Deletes a range of samples from a track.
  * After deletion, the track's content before and after the deleted range becomes contiguous.
+ * The range may include inserted (shared) portions; only the track's views of
+ * the samples are dropped, no samples are moved or copied.
  *
  * @param track The audio track
  * @param pos The starting position of the range to delete
  * @param len The number of samples to delete
- * @return true if deletion was successful, false otherwise
+ * @return true if deletion was successful, false if pos is past the end or memory ran out
  */
 bool tr_delete_range(struct sound_seg* track, size_t pos, size_t len);
 
+/**
+ * Merges adjacent segments of a track so later traversals visit fewer of
+ * them. Neighbours that view consecutive samples of one buffer become one
+ * segment, and runs of small segments that no other track shares are copied
+ * into one buffer. Segments shared with other tracks keep their buffers, so
+ * the track's content and sharing are unchanged.
+ *
+ * @param track The audio track
+ * @return true on success, false if memory ran out (the track stays valid)
+ */
+bool tr_compact(struct sound_seg* track);
+
+/**
+ * Makes edits compact a track automatically once its average segment
+ * length drops below min_node_len samples.
+ *
+ * @param track The audio track
+ * @param min_node_len The least average segment length, 0 (the default) turns it off
+ */
+void tr_set_auto_compact(struct sound_seg* track, size_t min_node_len);
+
+/**
+ * Compresses the sample buffers of a track that were not read or written
+ * since the previous call, with a lossless codec (per block of 1024 samples,
+ * a fixed polynomial predictor of order 0 to 4 or a fitted order-8 linear
+ * predictor, then Rice coding). Calling it periodically keeps the buffers
+ * that stay idle for a whole period compressed. Reads decode compressed
+ * samples on the fly and leave them compressed. A write into a compressed
+ * buffer no other node views gives just the written range a buffer of its
+ * own and leaves the rest compressed; when inserted copies view it, the
+ * buffer is decompressed in place so they see the write. An append after a
+ * compressed tail starts a new segment and leaves the tail compressed.
+ * Buffers of memory-mapped files are left alone.
+ *
+ * @param track The audio track
+ * @return true on success, false if memory ran out (the track stays valid)
+ */
+bool tr_compress_cold(struct sound_seg* track);
+
 /**
  * Identifies occurrences of an advertisement within a target track.
  *
@@ -114,9 +359,199 @@ bool tr_delete_range(struct sound_seg* track, size_t pos, size_t len);
  */
 char* tr_identify(const struct sound_seg* target, const struct sound_seg* ad);
 
+/**
+ * Sets how many threads tr_identify scans with.
+ * The target is split into chunks that are scanned on a pool of workers;
+ * the result is the same as a single-threaded scan.
+ *
+ * @param threads Number of threads, 1 (the default) scans on the calling
+ *                thread only, 0 uses one thread per online CPU
+ */
+void tr_set_threads(size_t threads);
+
+/**
+ * A match of an ad: the first and the last sample index it covers.
+ */
+struct ad_match {
+    size_t start;
+    size_t end;
+};
+
+/**
+ * A growable list of matches. Start from a zeroed list; functions that
+ * report matches append to it, ad_match_list_free releases it.
+ */
+struct ad_match_list {
+    struct ad_match* matches;
+    size_t count;
+    size_t capacity;
+};
+
+/**
+ * Frees the matches of a list and resets it to empty.
+ *
+ * @param list The list to free
+ */
+void ad_match_list_free(struct ad_match_list* list);
+
+/**
+ * Options of tr_identify_ex. ad_identify_options_init sets the ones
+ * tr_identify uses.
+ */
+struct ad_identify_options {
+    double threshold; // a match correlates with the ad at least this fraction of the ad's auto-correlation (0.95)
+    bool overlap; // report matches that overlap an earlier one (false: the scan skips past each match)
+    size_t window_start; // only matches inside target samples [window_start, window_start + window_len)
+    size_t window_len; // 0: up to the end of the target
+    size_t max_matches; // stop scanning after this many matches, 0: no limit
+    size_t decimation; // coarse-to-fine: block size of the prefilter fingerprints (8 works well), 0: exhaustive scan
+};
+
+/**
+ * A match of an ad with its score: the correlation of the target with the
+ * ad over the match divided by the ad's auto-correlation.
+ */
+struct ad_hit {
+    size_t start;
+    size_t end;
+    double score;
+};
+
+/**
+ * A growable list of scored matches. Start from a zeroed list, or from one
+ * whose hits array came from malloc with capacity set: matches are appended
+ * and the array is only reallocated when it is full, so a list emptied by
+ * setting count to 0 can be reused without allocating. ad_hit_list_free
+ * releases it.
+ */
+struct ad_hit_list {
+    struct ad_hit* hits;
+    size_t count;
+    size_t capacity;
+};
+
+/**
+ * Sets options to the ones tr_identify uses.
+ *
+ * @param opts The options to set
+ */
+void ad_identify_options_init(struct ad_identify_options* opts);
+
+/**
+ * Frees the matches of a list and resets it to empty.
+ *
+ * @param list The list to free
+ */
+void ad_hit_list_free(struct ad_hit_list* list);
+
+/**
+ * Identifies occurrences of an advertisement within a target track and
+ * appends them to a list instead of formatting a string. With the default
+ * options the matches are the ones tr_identify reports. A search window
+ * scans as if the target started at the window; with max_matches the scan
+ * stops as soon as it has found that many. With a decimation factor d > 1
+ * block sums of d samples of target and ad are correlated first, at every
+ * d-th offset, and only the offsets near their peaks are tested against the
+ * threshold. A match whose block sums correlate poorly (energy mostly above
+ * 4000 / d Hz in the target window) can be missed. With overlap set, every
+ * match reported is also reported by the exhaustive scan. Without it,
+ * matches can shift: when the exhaustive scan's match is missed or falls
+ * outside the tested offsets, a neighbouring offset it would have skipped
+ * can be reported instead. Ads that keep less than 40% of their energy in
+ * block sums, or are shorter than 8 blocks, are scanned exhaustively.
+ *
+ * @param target The target audio track to search in
+ * @param ad The advertisement audio track to search for
+ * @param opts The options, NULL for the defaults
+ * @param out The list the matches are appended to, in increasing order of start
+ * @return true on success, false with out unchanged if memory ran out
+ */
+bool tr_identify_ex(const struct sound_seg* target, const struct sound_seg* ad,
+                    const struct ad_identify_options* opts, struct ad_hit_list* out);
+
+/**
+ * Identifies occurrences of several advertisements in one pass over a target.
+ * The target is read once and its transforms are shared by all ads; the
+ * matches of each ad are the ones tr_identify reports for that ad.
+ *
+ * @param target The target audio track to search in
+ * @param ads The advertisement audio tracks to search for
+ * @param nads The number of advertisements
+ * @param results An array of nads lists, the matches of ads[i] are appended to results[i]
+ * @return true on success, false if memory ran out
+ */
+bool tr_identify_many(const struct sound_seg* target, const struct sound_seg* const* ads,
+                      size_t nads, struct ad_match_list* results);
+
+/**
+ * Removes every occurrence of an advertisement from a target track.
+ * The occurrences are the ones tr_identify reports, and they are cut out
+ * together in one pass over the target's segments: the samples left keep
+ * their buffers, and no sample is copied.
+ *
+ * @param target The audio track to remove the ad from
+ * @param ad The advertisement audio track to search for
+ * @param removed If not NULL, the removed occurrences are appended to it,
+ *                as positions in target before the removal
+ * @return true on success, false with the track unchanged if memory ran out
+ */
+bool tr_strip(struct sound_seg* target, const struct sound_seg* ad, struct ad_match_list* removed);
+
+/**
+ * A detector that finds an ad in a stream fed chunk by chunk.
+ * This is an opaque structure - details are defined in the implementation file.
+ */
+struct ad_detector;
+
+/**
+ * Creates a streaming detector for an advertisement.
+ * The detector copies the ad and keeps O(ad length) samples of history.
+ *
+ * @param ad The advertisement audio track to search for
+ * @return The new detector, or NULL if the ad is empty or memory ran out
+ */
+struct ad_detector* ad_detector_init(const struct sound_seg* ad);
+
+/**
+ * Destroys a detector and frees all associated resources.
+ *
+ * @param det The detector to destroy
+ */
+void ad_detector_destroy(struct ad_detector* det);
+
+/**
+ * Feeds the next samples of the stream to a detector.
+ * Confirmed matches are appended to out, with positions counted from the
+ * first sample ever fed. The matches are the ones tr_identify reports on
+ * everything fed so far. Ads shorter than 256 samples are reported as soon
+ * as their last sample arrives; longer ads are scanned in rounds of a few
+ * ad lengths, see ad_detector_flush.
+ *
+ * @param det The detector
+ * @param samples The new samples
+ * @param len The number of new samples
+ * @param out The list the confirmed matches are appended to
+ * @return true on success, false if memory ran out
+ */
+bool ad_detector_feed(struct ad_detector* det, const int16_t* samples, size_t len,
+                      struct ad_match_list* out);
+
+/**
+ * Scans the complete windows a detector is still holding back for its next
+ * round, e.g. at the end of the stream.
+ *
+ * @param det The detector
+ * @param out The list the confirmed matches are appended to
+ * @return true on success, false if memory ran out
+ */
+bool ad_detector_flush(struct ad_detector* det, struct ad_match_list* out);
+
 /**
  * Inserts a portion of a source track into a destination track.
- * The inserted portion shares backing store with the source.
+ * The inserted portion shares backing store with the source: it views the
+ * source's sample buffers, which stay alive until no track uses them.
+ * Writes to the source are visible in the inserted portion; a write to the
+ * inserted portion copies only the samples it overwrites.
  *
  * @param src_track The source audio track
  * @param dest_track The destination audio track
@@ -127,4 +562,77 @@ char* tr_identify(const struct sound_seg* target, const struct sound_seg* ad);
 void tr_insert(struct sound_seg* src_track, struct sound_seg* dest_track, 
               size_t destpos, size_t srcpos, size_t len);
 
+/**
+ * A set of edits to one track applied together.
+ * This is an opaque structure - details are defined in the implementation file.
+ */
+struct tr_batch;
+
+/**
+ * Starts a batch of edits to a track. Positions given to the batch refer to
+ * the track as it is at commit, before any of the batch's edits. The commit
+ * gives the same track as applying the edits one by one from the highest
+ * position down, where a write or delete goes before the inserts at its
+ * start position and inserts at one position end up in the order added.
+ *
+ * @param track The track to edit
+ * @return The batch, or NULL if the track is NULL or memory ran out
+ */
+struct tr_batch* tr_batch_begin(struct sound_seg* track);
+
+/**
+ * Adds a write to a batch, like tr_write. The samples are copied.
+ * Writes may not overlap other writes or deletes.
+ *
+ * @param batch The batch
+ * @param src The samples to write
+ * @param pos The position in the track to start writing
+ * @param len The number of samples to write
+ * @return true on success, false if memory ran out
+ */
+bool tr_batch_write(struct tr_batch* batch, const int16_t* src, size_t pos, size_t len);
+
+/**
+ * Adds a delete to a batch, like tr_delete_range. Deletes may overlap
+ * each other; the samples in any of them are deleted.
+ *
+ * @param batch The batch
+ * @param pos The position of the first sample to delete
+ * @param len The number of samples to delete
+ * @return true on success, false if memory ran out
+ */
+bool tr_batch_delete(struct tr_batch* batch, size_t pos, size_t len);
+
+/**
+ * Adds an insert to a batch, like tr_insert. The range of the source is
+ * taken as it is at commit; when the source is the edited track itself,
+ * that is before the batch's edits. An insert may not fall strictly
+ * inside a write or delete.
+ *
+ * @param batch The batch
+ * @param src_track The source audio track
+ * @param destpos The position in the edited track to insert at
+ * @param srcpos The starting position in the source track
+ * @param len The number of samples to insert
+ * @return true on success, false if memory ran out
+ */
+bool tr_batch_insert(struct tr_batch* batch, struct sound_seg* src_track, size_t destpos, size_t srcpos, size_t len);
+
+/**
+ * Applies the edits of a batch and frees it.
+ *
+ * @param batch The batch
+ * @return true on success; false, with the track unchanged, if an edit could
+ *         not be recorded or the edits overlap in a way not allowed above;
+ *         false as well if memory ran out while applying them
+ */
+bool tr_batch_commit(struct tr_batch* batch);
+
+/**
+ * Frees a batch without applying its edits.
+ *
+ * @param batch The batch
+ */
+void tr_batch_abort(struct tr_batch* batch);
+
 #endif /* SOUND_SEG_H */
\ No newline at end of file